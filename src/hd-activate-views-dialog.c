@@ -39,13 +39,20 @@
 
 #include "hd-activate-views-dialog.h"
 #include "hd-backgrounds.h"
+#include "hd-cairo-surface-cache.h"
 #include "hd-change-background-dialog.h"
+#include "hd-pixbuf-utils.h"
 
 #define HD_GCONF_KEY_ACTIVE_VIEWS "/apps/osso/hildon-desktop/views/active"
 #define HD_DESKTOP_VIEWS_MAX 9
 
 /* Images folder */
 #define USER_IMAGES_FOLDER "MyDocs", ".images"
+
+/* Size of the view thumbnails, keeps the aspect ratio of the screen */
+#define THUMBNAIL_WIDTH 125
+#define THUMBNAIL_HEIGHT 75
+#define PORTRAIT_THUMBNAIL_WIDTH 45
 enum
 {
   COL_PIXBUF,
@@ -68,6 +75,45 @@ struct _HDActivateViewsDialogPrivate
 
 G_DEFINE_TYPE (HDActivateViewsDialog, hd_activate_views_dialog, GTK_TYPE_DIALOG);
 
+static void
+set_view_thumbnail (GtkTreeModel    *model,
+                    GtkTreeIter     *iter,
+                    cairo_surface_t *surface)
+{
+  GdkPixbuf *pixbuf;
+
+  pixbuf = hd_pixbuf_utils_new_from_surface (surface);
+  gtk_list_store_set (GTK_LIST_STORE (model),
+                      iter,
+                      COL_PIXBUF, pixbuf,
+                      -1);
+  g_object_unref (pixbuf);
+}
+
+static void
+view_thumbnail_loaded (HDCairoSurfaceCache *cache,
+                       cairo_surface_t     *surface,
+                       gpointer             data)
+{
+  GtkTreeRowReference *row = data;
+
+  if (!surface)
+    g_warning ("%s. Could not get background image for view", __FUNCTION__);
+  else if (gtk_tree_row_reference_valid (row))
+    {
+      GtkTreeModel *model = gtk_tree_row_reference_get_model (row);
+      GtkTreePath *path = gtk_tree_row_reference_get_path (row);
+      GtkTreeIter iter;
+
+      if (gtk_tree_model_get_iter (model, &iter, path))
+        set_view_thumbnail (model, &iter, surface);
+
+      gtk_tree_path_free (path);
+    }
+
+  gtk_tree_row_reference_free (row);
+}
+
 static void
 hd_activate_views_dialog_dispose (GObject *object)
 {
@@ -268,40 +314,35 @@ hd_activate_views_dialog_init (HDActivateViewsDialog *dialog)
     {
       gchar *bg_image;
       GdkPixbuf *pixbuf;
+      cairo_surface_t *surface;
       GtkTreeIter iter;
       GtkTreePath *path;
+      gint width;
 
       if (hd_change_background_dialog_is_portrait () 
             && hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
-        bg_image = g_strdup_printf ("%s/.backgrounds/background_portrait-%u.png",
-                                    g_get_home_dir (),
-                                    i);
-      else
-        bg_image = g_strdup_printf ("%s/.backgrounds/background-%u.png",
-                                    g_get_home_dir (),
-                                    i);        
-
-      pixbuf = gdk_pixbuf_new_from_file_at_scale (bg_image, 125, 75, TRUE, &error);
-
-      if (error)
         {
-          g_warning ("Could not get background image for view %u, '%s'. %s",
-                     i, bg_image, error->message);
-          g_clear_error (&error);
+          bg_image = g_strdup_printf ("%s/.backgrounds/background_portrait-%u.png",
+                                      g_get_home_dir (),
+                                      i);
+          width = PORTRAIT_THUMBNAIL_WIDTH;
         }
-
-      g_free (bg_image);
-
-      if (!pixbuf)
+      else
         {
-          pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
-                                   TRUE,
-                                   8,
-                                   125, 75);
-          gdk_pixbuf_fill (pixbuf,
-                           0x000000ff);
+          bg_image = g_strdup_printf ("%s/.backgrounds/background-%u.png",
+                                      g_get_home_dir (),
+                                      i);
+          width = THUMBNAIL_WIDTH;
         }
 
+      /* Insert a black placeholder until the scaled image is loaded */
+      pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+                               FALSE,
+                               8,
+                               width, THUMBNAIL_HEIGHT);
+      gdk_pixbuf_fill (pixbuf,
+                       0x000000ff);
+
       gtk_list_store_insert_with_values (GTK_LIST_STORE (priv->model),
                                          &iter,
                                          -1,
@@ -310,6 +351,29 @@ hd_activate_views_dialog_init (HDActivateViewsDialog *dialog)
 
       path = gtk_tree_model_get_path (priv->model, &iter);
 
+      /* Scaled thumbnails are shared between dialog openings */
+      surface = hd_cairo_surface_cache_lookup_scaled_surface (hd_cairo_surface_cache_get (),
+                                                              bg_image,
+                                                              width,
+                                                              THUMBNAIL_HEIGHT,
+                                                              CAIRO_CONTENT_COLOR);
+      if (surface)
+        {
+          set_view_thumbnail (priv->model, &iter, surface);
+          cairo_surface_destroy (surface);
+        }
+      else
+        hd_cairo_surface_cache_get_scaled_surface_async (hd_cairo_surface_cache_get (),
+                                                         bg_image,
+                                                         width,
+                                                         THUMBNAIL_HEIGHT,
+                                                         CAIRO_CONTENT_COLOR,
+                                                         view_thumbnail_loaded,
+                                                         gtk_tree_row_reference_new (priv->model,
+                                                                                     path));
+
+      g_free (bg_image);
+
       if (active_views[i - 1])
         {
           gtk_icon_view_select_path (GTK_ICON_VIEW (priv->icon_view),
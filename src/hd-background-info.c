@@ -36,6 +36,9 @@
 #define BACKGROUND_INFO_KEY_FILE_FMT "File-%u"
 #define BACKGROUND_INFO_KEY_ETAG_FMT "Etag-%u"
 
+/* Updates within this time are written together */
+#define SAVE_TIMEOUT 500
+
 #define HD_BACKGROUND_INFO_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_BACKGROUND_INFO, HDBackgroundInfoPrivate))
 
@@ -43,6 +46,15 @@ struct _HDBackgroundInfoPrivate
 {
   GPtrArray *etags;
   HDObjectVector *files;
+
+  /* Saving is deferred while frozen */
+  guint freeze_count;
+  gboolean dirty;
+
+  /* Debounced asynchronous save */
+  guint save_timeout_id;
+  gboolean saving;
+  gchar *save_contents;
 };
 
 static void hd_background_info_dispose (GObject *object);
@@ -69,7 +81,9 @@ static char *get_etag_from_key_file (GKeyFile *key_file,
 static void load_background_info_legacy (HDBackgroundInfo *info,
                                          char             *file_contents,
                                          gsize             file_size);
-static void save_background_info_file (HDBackgroundInfo *info);
+static void schedule_save_background_info_file (HDBackgroundInfo *info);
+static gchar *get_background_info_contents (HDBackgroundInfo *info,
+                                            gsize            *length);
 
 G_DEFINE_TYPE (HDBackgroundInfo, hd_background_info, G_TYPE_OBJECT);
 
@@ -384,6 +398,9 @@ hd_background_info_dispose (GObject *object)
 {
   HDBackgroundInfoPrivate *priv = HD_BACKGROUND_INFO (object)->priv;
 
+  if (priv->save_timeout_id)
+    priv->save_timeout_id = (g_source_remove (priv->save_timeout_id), 0);
+
   if (priv->etags)
     {
       g_ptr_array_free (priv->etags, FALSE);
@@ -442,19 +459,194 @@ hd_background_info_set (HDBackgroundInfo *info,
   g_ptr_array_index (priv->etags,
                      desktop) = g_strdup (etag);
 
-  save_background_info_file (info);
+  priv->dirty = TRUE;
+
+  if (!priv->freeze_count)
+    schedule_save_background_info_file (info);
+}
+
+/**
+ * hd_background_info_freeze:
+ * @info: a #HDBackgroundInfo
+ *
+ * Defers writing the info file until hd_background_info_thaw(), so
+ * several calls to hd_background_info_set() are saved at once.
+ */
+void
+hd_background_info_freeze (HDBackgroundInfo *info)
+{
+  g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
+
+  info->priv->freeze_count++;
+}
+
+/**
+ * hd_background_info_thaw:
+ * @info: a #HDBackgroundInfo
+ *
+ * Reverts hd_background_info_freeze() and schedules writing the info file
+ * if it was changed in between.
+ */
+void
+hd_background_info_thaw (HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv;
+
+  g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
+
+  priv = info->priv;
+
+  g_return_if_fail (priv->freeze_count > 0);
+
+  if (--priv->freeze_count == 0 && priv->dirty)
+    schedule_save_background_info_file (info);
+}
+
+/**
+ * hd_background_info_flush:
+ * @info: a #HDBackgroundInfo
+ *
+ * Writes pending changes of the info file synchronously, called on
+ * shutdown.
+ */
+void
+hd_background_info_flush (HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv;
+  GFile *background_info_file;
+  gchar *contents;
+  gsize length;
+  GError *error = NULL;
+
+  g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
+
+  priv = info->priv;
+
+  if (priv->save_timeout_id)
+    priv->save_timeout_id = (g_source_remove (priv->save_timeout_id), 0);
+
+  /* A running write must not overwrite the newer contents afterwards */
+  while (priv->saving)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (!priv->dirty)
+    return;
+
+  priv->dirty = FALSE;
+
+  contents = get_background_info_contents (info, &length);
+  background_info_file = get_background_info_file ();
+
+  g_file_replace_contents (background_info_file,
+                           contents,
+                           length,
+                           NULL,
+                           FALSE,
+                           G_FILE_CREATE_NONE,
+                           NULL,
+                           NULL,
+                           &error);
+
+  if (error)
+    {
+      g_warning ("%s. Could not write cache info file. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+    }
+
+  g_free (contents);
+  g_object_unref (background_info_file);
+}
+
+static void
+save_background_info_file_finished (GFile            *file,
+                                    GAsyncResult     *result,
+                                    HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv = info->priv;
+  GError *error = NULL;
+
+  g_file_replace_contents_finish (file,
+                                  result,
+                                  NULL,
+                                  &error);
+
+  if (error)
+    {
+      g_warning ("%s. Could not write cache info file. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+    }
+
+  priv->save_contents = (g_free (priv->save_contents), NULL);
+  priv->saving = FALSE;
+
+  /* Changed while writing */
+  if (priv->dirty && !priv->freeze_count)
+    schedule_save_background_info_file (info);
+
+  g_object_unref (info);
+}
+
+static gboolean
+save_background_info_file_timeout (HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv = info->priv;
+  GFile *background_info_file;
+  gsize length;
+
+  priv->save_timeout_id = 0;
+
+  priv->dirty = FALSE;
+  priv->saving = TRUE;
+
+  /* Kept until the write is finished */
+  priv->save_contents = get_background_info_contents (info, &length);
+  background_info_file = get_background_info_file ();
+
+  g_file_replace_contents_async (background_info_file,
+                                 priv->save_contents,
+                                 length,
+                                 NULL,
+                                 FALSE,
+                                 G_FILE_CREATE_NONE,
+                                 NULL,
+                                 (GAsyncReadyCallback) save_background_info_file_finished,
+                                 g_object_ref (info));
+
+  g_object_unref (background_info_file);
+
+  return FALSE;
 }
 
+/* Writes the info file once no further changes came in for SAVE_TIMEOUT,
+ * or after the running write finished */
 static void
-save_background_info_file (HDBackgroundInfo *info)
+schedule_save_background_info_file (HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv = info->priv;
+
+  if (priv->saving)
+    return;
+
+  if (priv->save_timeout_id)
+    g_source_remove (priv->save_timeout_id);
+
+  priv->save_timeout_id = gdk_threads_add_timeout (SAVE_TIMEOUT,
+                                                   (GSourceFunc) save_background_info_file_timeout,
+                                                   info);
+}
+
+static gchar *
+get_background_info_contents (HDBackgroundInfo *info,
+                              gsize            *length)
 {
   HDBackgroundInfoPrivate *priv = info->priv;
   GKeyFile *key_file = g_key_file_new ();
-  GFile *background_info_file;
   guint desktop;
   gchar *contents;
-  gsize length;
-  GError *error = NULL;
 
   g_key_file_set_integer (key_file,
                           BACKGROUND_INFO_GROUP,
@@ -505,30 +697,10 @@ save_background_info_file (HDBackgroundInfo *info)
     }
 
   contents = g_key_file_to_data (key_file,
-                                 &length,
+                                 length,
                                  NULL);
 
-  background_info_file = get_background_info_file ();
-
-  g_file_replace_contents (background_info_file,
-                           contents,
-                           length,
-                           NULL,
-                           FALSE,
-                           G_FILE_CREATE_NONE,
-                           NULL,
-                           NULL,
-                           &error);
-
-  if (error)
-    {
-      g_warning ("%s. Could not write cache info file. %s",
-                 __FUNCTION__,
-                 error->message);
-      g_error_free (error);
-    }
-
   g_key_file_free (key_file);
-  g_free (contents);
-  g_object_unref (background_info_file);
+
+  return contents;
 }
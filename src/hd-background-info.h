@@ -71,6 +71,9 @@ void              hd_background_info_set      (HDBackgroundInfo *info,
                                                guint             desktop,
                                                GFile            *file,
                                                const char       *etag);
+void              hd_background_info_freeze   (HDBackgroundInfo *info);
+void              hd_background_info_thaw     (HDBackgroundInfo *info);
+void              hd_background_info_flush    (HDBackgroundInfo *info);
 
 
 
@@ -36,6 +36,8 @@
 
 #include <gconf/gconf-client.h>
 
+#include <errno.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "hd-background-info.h"
@@ -43,6 +45,7 @@
 #include "hd-desktop.h"
 #include "hd-file-background.h"
 #include "hd-pixbuf-utils.h"
+#include "hd-render-cache.h"
 
 #include "hd-backgrounds.h"
 
@@ -50,8 +53,29 @@
 #define BACKGROUND_CACHED_PNG CACHED_DIR "/background-%u.png"
 #define BACKGROUND_CACHED_PNG_PORTRAIT CACHED_DIR "/background_portrait-%u.png"
 
+/* Images rendered for previously used backgrounds */
+#define RENDER_CACHE_DIR  CACHED_DIR "/rendered"
+#define RENDER_CACHE_SIZE (16 * 1024 * 1024)
+
+/* Number of images kept from hd_backgrounds_prerender () */
+#define PRERENDERED_IMAGES 2
+
 #define GCONF_KEY_PORTRAIT_WALLPAPER "/apps/osso/hildon-desktop/portrait_wallpaper"
 
+/* Whether a low quality preview is shown while a background is rendered */
+#define GCONF_KEY_PROGRESSIVE_WALLPAPER "/apps/osso/hildon-desktop/progressive_wallpaper"
+
+/* The cached image replaced by a preview, restored if the render fails */
+#define PREVIEW_BACKUP_SUFFIX ".previous"
+
+/* Number of threads creating cached images in parallel */
+#define CACHED_IMAGE_WORKERS 2
+
+/* Upper limit for the memory of images decoded in parallel */
+#define DECODE_MEMORY_BUDGET (48 * 1024 * 1024)
+/* Assumed decode memory if the image size is not known in advance */
+#define DEFAULT_DECODE_MEMORY (4 * HD_SCREEN_WIDTH * HD_SCREEN_HEIGHT * 4)
+
 /* Background GConf key */
 #define GCONF_DIR                 "/apps/osso/hildon-desktop/views"
 #define GCONF_BACKGROUND_KEY      GCONF_DIR "/%u/bg-image"
@@ -69,10 +93,25 @@
 #define HD_BACKGROUNDS_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_BACKGROUNDS, HDBackgroundsPrivate))
 
+/* Serializes the writes of the cached image of a view */
+typedef struct
+{
+  GMutex mutex;
+
+  /* The job whose preview is shown, the preview file */
+  GCancellable *preview_owner;
+  dev_t preview_dev;
+  ino_t preview_ino;
+  gboolean has_backup;
+} CachedImageState;
+
 typedef struct
 {
   GFile *file;
+  guint view;
+  guint command_id;
   gboolean error_dialogs;
+  gboolean update_gconf;
   GCancellable *cancellable;
 } CacheImageRequestData;
 
@@ -82,6 +121,7 @@ struct _HDBackgroundsPrivate
 
   /* GConf notify handlers */
   guint bg_image_notify[HD_DESKTOP_VIEWS*2];
+  guint current_view_notify;
 
   /* Data used for the thread which creates the cached images */
   HDCommandThreadPool *thread_pool;
@@ -91,9 +131,20 @@ struct _HDBackgroundsPrivate
   /* background info */
   HDBackgroundInfo *info;
 
+  /* UpdateCacheInfoData from the commands, applied together in an idle */
+  GMutex info_mutex;
+  GQueue info_updates;
+  guint info_updates_idle_id;
+
   /* Theme change support */
   gchar *current_theme;
   guint set_theme_idle_id;
+  gint64 theme_change_time;
+
+  /* Estimated memory of the images being decoded */
+  GMutex decode_memory_mutex;
+  GCond decode_memory_cond;
+  gsize decode_memory;
 
   GVolumeMonitor *volume_monitor;
 #ifdef DEAD_CODE_TO_REMOVE
@@ -101,44 +152,289 @@ struct _HDBackgroundsPrivate
 #endif
 
   gboolean portrait_wallpaper;
+
+  /* Sources shared by queued commands, URI -> HDBackgroundsSource */
+  GMutex sources_mutex;
+  GHashTable *sources;
+
+  HDRenderCache *render_cache;
+
+  /* Progressive apply, see hd_backgrounds_source_publish_preview () */
+  gboolean progressive_wallpaper;
+  gint visible_view;
+  CachedImageState cached_images[HD_DESKTOP_VIEWS * 2];
+
+  /* PrerenderedImages, most recently rendered first */
+  GMutex prerendered_mutex;
+  GQueue prerendered;
+  guint prerender_command_id;
+};
+
+/* An image rendered ahead by hd_backgrounds_prerender () */
+typedef struct
+{
+  gchar *uri;
+  guint view;
+  gchar *etag;
+  GdkPixbuf *pixbuf;
+} PrerenderedImage;
+
+typedef struct
+{
+  HDBackgroundsSource *source;
+  guint view;
+  GCancellable *cancellable;
+} PrerenderData;
+
+/*
+ * A source image which is decoded only once for all commands which use it,
+ * e.g. when the landscape and portrait background of a view are the same.
+ */
+struct _HDBackgroundsSource
+{
+  HDBackgrounds *backgrounds;
+
+  /* Protected by sources_mutex */
+  guint ref_count;
+  gchar *uri;
+
+  GFile *file;
+
+  GMutex mutex;
+  GCond cond;
+  gboolean loading;
+
+  /* Result of the last successful load */
+  HDImageSize size;
+  GdkPixbuf *pixbuf;
+  gchar *etag;
+
+  /* Cached image saved from pixbuf, other views link to it */
+  gboolean saving;
+  gchar *saved_path;
+  dev_t saved_dev;
+  ino_t saved_ino;
 };
 
 static CacheImageRequestData *cache_image_request_data_new (GFile        *file,
+                                                            guint         view,
                                                             gboolean      error_dialogs,
+                                                            gboolean      update_gconf,
                                                             GCancellable *cancellable);
 static void cache_image_request_data_free (CacheImageRequestData *data);
 
 static gboolean remove_request (CacheImageRequestData *request);
+static gboolean update_cache_info_file_idle (HDBackgrounds *backgrounds);
+static void prerendered_image_free (PrerenderedImage *image);
+static void restore_interrupted_previews (void);
 
 G_DEFINE_TYPE (HDBackgrounds, hd_backgrounds, G_TYPE_OBJECT);
 
+/* Returns the current desktop view in 0..HD_DESKTOP_VIEWS-1 */
+static guint
+get_current_view (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gint current_view;
+
+  current_view = gconf_client_get_int (priv->gconf_client,
+                                       GCONF_CURRENT_DESKTOP_KEY,
+                                       NULL) - 1;
+
+  return CLAMP (current_view, 0, HD_DESKTOP_VIEWS - 1);
+}
+
+/* Landscape and portrait images of the current view come first */
+static HDCommandPriority
+get_priority_for_view (HDBackgrounds *backgrounds,
+                       guint          view)
+{
+  if (view == HD_BACKGROUNDS_ALL_VIEWS ||
+      view % HD_DESKTOP_VIEWS == get_current_view (backgrounds))
+    return HD_COMMAND_PRIORITY_CURRENT_VIEW;
+
+  return HD_COMMAND_PRIORITY_OTHER_VIEWS;
+}
+
 static void
-create_cached_background (HDBackgrounds *backgrounds,
-                          GFile         *image_file,
-                          guint          view,
-                          gboolean       error_dialogs,
-                          gboolean       update_gconf)
+gconf_current_view_notify (GConfClient   *client,
+                           guint          cnxn_id,
+                           GConfEntry    *entry,
+                           HDBackgrounds *backgrounds)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
+  guint i;
+
+  g_atomic_int_set (&priv->visible_view,
+                    get_current_view (backgrounds));
+
+  /* Move queued images of the new current view to the front */
+  for (i = 0; i < priv->requests->len; i++)
+    {
+      CacheImageRequestData *request = g_ptr_array_index (priv->requests, i);
+
+      hd_command_thread_pool_set_priority (priv->thread_pool,
+                                           request->command_id,
+                                           get_priority_for_view (backgrounds,
+                                                                  request->view));
+    }
+}
+
+/*
+ * Maps 0..n_views-1 to the views in the order landscape 1, portrait 1,
+ * landscape 2 and so on when portrait wallpapers are enabled.
+ */
+static guint
+get_view_for_index (guint index,
+                    guint n_views)
+{
+  if (n_views <= HD_DESKTOP_VIEWS)
+    return index;
+
+  return (index % 2) * HD_DESKTOP_VIEWS + index / 2;
+}
+
+/* A batch of views whose cached image may have to be recreated. The etags
+ * of the source images are checked on the worker pool, only the views
+ * which are actually out of date are queued for regeneration afterwards */
+typedef struct
+{
+  HDBackgrounds *backgrounds;
+
+  guint n_views;
+  guint views[HD_DESKTOP_VIEWS * 2];
+  GFile *files[HD_DESKTOP_VIEWS * 2];
+  gchar *etags[HD_DESKTOP_VIEWS * 2];
+  gboolean outdated[HD_DESKTOP_VIEWS * 2];
+
+  gboolean error_dialogs;
+  gboolean update_gconf;
+  gboolean restart;
+} BackgroundCheck;
+
+static gboolean restart_hildon_home (HDBackgrounds *backgrounds);
+
+static BackgroundCheck *
+background_check_new (HDBackgrounds *backgrounds,
+                      gboolean       error_dialogs,
+                      gboolean       update_gconf)
+{
+  BackgroundCheck *check = g_slice_new0 (BackgroundCheck);
+
+  check->backgrounds = backgrounds;
+  check->error_dialogs = error_dialogs;
+  check->update_gconf = update_gconf;
+
+  return check;
+}
+
+static void
+background_check_free (BackgroundCheck *check)
+{
+  guint i;
+
+  for (i = 0; i < check->n_views; i++)
+    {
+      g_object_unref (check->files[i]);
+      g_free (check->etags[i]);
+    }
+
+  g_slice_free (BackgroundCheck, check);
+}
+
+/* Called on the main thread, the background info is only read here */
+static void
+background_check_add (BackgroundCheck *check,
+                      GFile           *image_file,
+                      guint            view)
+{
+  HDBackgroundsPrivate *priv = check->backgrounds->priv;
   GFile *current_file;
   const char *current_etag;
-  gboolean create_cached_background = TRUE;
+  guint i = check->n_views;
+
+  g_return_if_fail (i < G_N_ELEMENTS (check->views));
 
   current_file = hd_background_info_get_file (priv->info,
                                               view);
   current_etag = hd_background_info_get_etag (priv->info,
                                               view);
 
+  check->views[i] = view;
+  check->files[i] = g_object_ref (image_file);
+
   if (current_file &&
       current_etag &&
       g_file_equal (current_file,
                     image_file))
+    check->etags[i] = g_strdup (current_etag);
+  else
+    check->outdated[i] = TRUE;
+
+  check->n_views++;
+}
+
+static void
+create_cached_background (HDBackgrounds *backgrounds,
+                          GFile         *image_file,
+                          guint          view,
+                          gboolean       error_dialogs,
+                          gboolean       update_gconf)
+{
+  HDBackground *background;
+  GCancellable *cancellable = g_cancellable_new ();
+
+  background = hd_file_background_new (image_file);
+
+  hd_file_background_set_for_view_full (HD_FILE_BACKGROUND (background),
+                                        view,
+                                        cancellable,
+                                        error_dialogs,
+                                        update_gconf);
+
+  g_object_unref (cancellable);
+}
+
+static gboolean
+background_check_done (BackgroundCheck *check)
+{
+  HDBackgroundsPrivate *priv = check->backgrounds->priv;
+  guint i;
+
+  /* Views keep the order in which they were added */
+  for (i = 0; i < check->n_views; i++)
+    if (check->outdated[i])
+      create_cached_background (check->backgrounds,
+                                check->files[i],
+                                check->views[i],
+                                check->error_dialogs,
+                                check->update_gconf);
+
+  /* Runs when the cached images of all views are created */
+  if (check->restart)
+    hd_command_thread_pool_push_idle (priv->thread_pool,
+                                      G_PRIORITY_HIGH_IDLE,
+                                      (GSourceFunc) restart_hildon_home,
+                                      check->backgrounds,
+                                      NULL);
+
+  return FALSE;
+}
+
+static void
+background_check_command (BackgroundCheck *check)
+{
+  guint i;
+
+  for (i = 0; i < check->n_views; i++)
     {
       GFileInfo *info;
-      const char *etag;
       GError *error = NULL;
 
-      info = g_file_query_info (image_file,
+      if (check->outdated[i])
+        continue;
+
+      info = g_file_query_info (check->files[i],
                                 G_FILE_ATTRIBUTE_ETAG_VALUE,
                                 G_FILE_QUERY_INFO_NONE,
                                 NULL,
@@ -154,29 +450,48 @@ create_cached_background (HDBackgrounds *backgrounds,
 
       if (info)
         {
-          etag = g_file_info_get_etag (info);
-
-          create_cached_background = g_strcmp0 (current_etag, etag) != 0;
+          check->outdated[i] = g_strcmp0 (check->etags[i],
+                                          g_file_info_get_etag (info)) != 0;
 
           g_object_unref (info);
         }
     }
 
-  if (create_cached_background)
-    {
-      HDBackground *background;
-      GCancellable *cancellable = g_cancellable_new ();
+  /* Not a barrier idle, the regeneration has to be queued before a restart
+   * barrier is pushed */
+  gdk_threads_add_idle_full (G_PRIORITY_HIGH_IDLE,
+                             (GSourceFunc) background_check_done,
+                             check,
+                             (GDestroyNotify) background_check_free);
+}
+
+static void
+background_check_run (BackgroundCheck *check,
+                      gboolean         restart)
+{
+  HDBackgroundsPrivate *priv = check->backgrounds->priv;
+  guint i;
 
-      background = hd_file_background_new (image_file);
+  check->restart = restart;
 
-      hd_file_background_set_for_view_full (HD_FILE_BACKGROUND (background),
-                                            view,
-                                            cancellable,
-                                            error_dialogs,
-                                            update_gconf);
+  for (i = 0; i < check->n_views; i++)
+    if (!check->outdated[i])
+      break;
 
-      g_object_unref (cancellable);
+  /* Nothing to check, queue the regeneration right away */
+  if (i == check->n_views)
+    {
+      background_check_done (check);
+      background_check_free (check);
+      return;
     }
+
+  hd_command_thread_pool_push_full (priv->thread_pool,
+                                    HD_COMMAND_PRIORITY_CURRENT_VIEW,
+                                    "etag-check",
+                                    (HDCommandCallback) background_check_command,
+                                    check,
+                                    NULL);
 }
 
 static gboolean
@@ -332,11 +647,15 @@ gconf_bgimage_notify (GConfClient *client,
                                       GPOINTER_TO_UINT (user_data));
   if (bg_image)
     {
-      create_cached_background (backgrounds,
-                                bg_image,
-                                GPOINTER_TO_UINT (user_data),
-                                TRUE,
-                                FALSE);
+      BackgroundCheck *check = background_check_new (backgrounds,
+                                                     TRUE,
+                                                     FALSE);
+
+      background_check_add (check,
+                            bg_image,
+                            GPOINTER_TO_UINT (user_data));
+      background_check_run (check,
+                            FALSE);
 
       g_object_unref (bg_image);
     }
@@ -348,6 +667,7 @@ background_info_loaded (HDBackgroundInfo *info,
                         HDBackgrounds *backgrounds)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
+  BackgroundCheck *check;
   guint current_view, i;
   GFile *bg_image;
   GError *error = NULL;
@@ -384,42 +704,55 @@ background_info_loaded (HDBackgroundInfo *info,
 
   current_view = CLAMP (current_view, 0, max - 1);
 
+  check = background_check_new (backgrounds,
+                                FALSE,
+                                FALSE);
+
   /* Update cache for current view */
   bg_image = get_background_for_view (backgrounds,
                                       current_view);
   if (bg_image)
     {
-      create_cached_background (backgrounds,
-                                bg_image,
-                                current_view,
-                                FALSE,
-                                FALSE);
+      background_check_add (check,
+                            bg_image,
+                            current_view);
       g_object_unref (bg_image);
     }
 
-  /* Update cache for other views */
+  /* Update cache for other views, the landscape and portrait image of a
+   * view are queued together so a shared source is decoded only once */
   for (i = 0; i < max; i++)
     {
-      if (i != current_view)
+      guint view = get_view_for_index (i, max);
+
+      if (view != current_view)
         {
           bg_image = get_background_for_view (backgrounds,
-                                              i);
+                                              view);
           if (bg_image)
             {
-              create_cached_background (backgrounds,
-                                        bg_image,
-                                        i,
-                                        FALSE,
-                                        FALSE);
+              background_check_add (check,
+                                    bg_image,
+                                    view);
               g_object_unref (bg_image);
             }
         }
     }
+
+  background_check_run (check,
+                        FALSE);
 }
 
 static gboolean
-restart_hildon_home (gpointer data)
+restart_hildon_home (HDBackgrounds *backgrounds)
 {
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  g_message ("%s. Switching to theme %s took %" G_GINT64_FORMAT " ms",
+             __FUNCTION__,
+             priv->current_theme,
+             (g_get_monotonic_time () - priv->theme_change_time) / 1000);
+
   gtk_main_quit ();
 
   return FALSE;
@@ -449,6 +782,7 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
                                const gchar   *backgrounds_desktop)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
+  BackgroundCheck *check;
   GKeyFile *key_file;
   gchar *current_theme;
   gint current_view;
@@ -556,6 +890,12 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
 
   g_key_file_free (key_file);
 
+  /* Regenerate all views on all cores, hildon-home is restarted when done */
+  priv->theme_change_time = g_get_monotonic_time ();
+  hd_command_thread_pool_set_max_threads (priv->thread_pool,
+                                          MAX (CACHED_IMAGE_WORKERS,
+                                               g_get_num_processors ()));
+
   current_view = gconf_client_get_int (priv->gconf_client,
                                        GCONF_CURRENT_DESKTOP_KEY,
                                        &error);
@@ -574,36 +914,35 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
   /* Set to 0..HD_DESKTOP_VIEWS */
   current_view--;
 
-  if (current_view >= 0 && current_view < max_value)
-    create_cached_background (backgrounds,
-                              bg_image[current_view],
-                              current_view,
-                              FALSE,
-                              TRUE);
-
+  check = background_check_new (backgrounds,
+                                FALSE,
+                                TRUE);
 
+  if (current_view >= 0 && current_view < max_value)
+    background_check_add (check,
+                          bg_image[current_view],
+                          current_view);
 
   /* Update cache for other views */
   for (i = 0; i < max_value; i++)
     {
-      if (i != current_view)
+      guint view = get_view_for_index (i, max_value);
+
+      if (view != current_view)
         {
-          create_cached_background (backgrounds,
-                                    bg_image[i],
-                                    i,
-                                    FALSE,
-                                    TRUE);
+          background_check_add (check,
+                                bg_image[view],
+                                view);
         }
     }
 
   for (i = 0; i < max_value; i++)
     g_object_unref (bg_image[i]);
 
-  hd_command_thread_pool_push_idle (priv->thread_pool,
-                                    G_PRIORITY_HIGH_IDLE,
-                                    restart_hildon_home,
-                                    NULL,
-                                    NULL);
+  /* hildon-home is restarted when the cached images of all views are
+   * created */
+  background_check_run (check,
+                        TRUE);
 }
 
 static gboolean
@@ -715,6 +1054,21 @@ hd_backgrounds_startup (HDBackgrounds *backgrounds)
       g_free (gconf_key);
     }
 
+  priv->current_view_notify = gconf_client_notify_add (priv->gconf_client,
+                                                       GCONF_CURRENT_DESKTOP_KEY,
+                                                       (GConfClientNotifyFunc) gconf_current_view_notify,
+                                                       backgrounds,
+                                                       NULL,
+                                                       &error);
+  if (error)
+    {
+      g_warning ("%s. Could not add notification to GConf %s. %s",
+                 __FUNCTION__,
+                 GCONF_CURRENT_DESKTOP_KEY,
+                 error->message);
+      g_clear_error (&error);
+    }
+
   /* When separate wallpapers for portrait mode are enabled */
   /* HD_DESKTOP_VIEWS..HD_DESKTOP_VIEWS * 2 are fake views, used to store informations */
   /* about wallpapers (for portrait mode). For example: */
@@ -751,6 +1105,33 @@ hd_backgrounds_startup (HDBackgrounds *backgrounds)
                                  backgrounds);
 }
 
+/**
+ * hd_backgrounds_shutdown:
+ * @backgrounds: the #HDBackgrounds
+ *
+ * Writes background info updates which are still pending, called when
+ * the main loop has quit.
+ */
+void
+hd_backgrounds_shutdown (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  guint idle_id;
+
+  g_mutex_lock (&priv->info_mutex);
+  idle_id = priv->info_updates_idle_id;
+  g_mutex_unlock (&priv->info_mutex);
+
+  if (idle_id)
+    {
+      g_source_remove (idle_id);
+      update_cache_info_file_idle (backgrounds);
+    }
+
+  if (priv->info)
+    hd_background_info_flush (priv->info);
+}
+
 static void
 mount_pre_unmount_cb (GVolumeMonitor *monitor,
                       GMount         *mount,
@@ -842,6 +1223,9 @@ static void
 hd_backgrounds_init (HDBackgrounds *backgrounds)
 {
   HDBackgroundsPrivate *priv;
+  gchar *render_cache_path;
+  GConfValue *progressive;
+  guint i;
 
   backgrounds->priv = HD_BACKGROUNDS_GET_PRIVATE (backgrounds);
   priv = backgrounds->priv;
@@ -850,7 +1234,32 @@ hd_backgrounds_init (HDBackgrounds *backgrounds)
 
   priv->requests = g_ptr_array_new ();
 
-  priv->thread_pool = hd_command_thread_pool_new ();
+  g_mutex_init (&priv->info_mutex);
+  g_queue_init (&priv->info_updates);
+
+  g_mutex_init (&priv->decode_memory_mutex);
+  g_cond_init (&priv->decode_memory_cond);
+
+  g_mutex_init (&priv->sources_mutex);
+  priv->sources = g_hash_table_new (g_str_hash, g_str_equal);
+
+  g_mutex_init (&priv->prerendered_mutex);
+  g_queue_init (&priv->prerendered);
+
+  for (i = 0; i < G_N_ELEMENTS (priv->cached_images); i++)
+    g_mutex_init (&priv->cached_images[i].mutex);
+
+  restore_interrupted_previews ();
+
+  priv->thread_pool = hd_command_thread_pool_new_full (CACHED_IMAGE_WORKERS);
+  hd_command_thread_pool_set_name (priv->thread_pool, "backgrounds");
+
+  render_cache_path = g_build_filename (g_get_home_dir (),
+                                        RENDER_CACHE_DIR,
+                                        NULL);
+  priv->render_cache = hd_render_cache_new (render_cache_path,
+                                            RENDER_CACHE_SIZE);
+  g_free (render_cache_path);
 
   priv->volume_monitor = g_volume_monitor_get ();
   g_signal_connect (priv->volume_monitor, "mount-pre-unmount",
@@ -864,6 +1273,18 @@ hd_backgrounds_init (HDBackgrounds *backgrounds)
 
   priv->portrait_wallpaper = gconf_client_get_bool (priv->gconf_client, GCONF_KEY_PORTRAIT_WALLPAPER, NULL);
 
+  /* Enabled unless switched off */
+  progressive = gconf_client_get (priv->gconf_client,
+                                  GCONF_KEY_PROGRESSIVE_WALLPAPER,
+                                  NULL);
+  priv->progressive_wallpaper = !progressive ||
+                                progressive->type != GCONF_VALUE_BOOL ||
+                                gconf_value_get_bool (progressive);
+  if (progressive)
+    gconf_value_free (progressive);
+
+  priv->visible_view = get_current_view (backgrounds);
+
 }
 
 static void
@@ -886,12 +1307,23 @@ hd_backgrounds_dipose (GObject *object)
             priv->bg_image_notify[i] = (gconf_client_notify_remove (priv->gconf_client,
                                                                     priv->bg_image_notify[i]), 0);
         }
+      if (priv->current_view_notify)
+        priv->current_view_notify = (gconf_client_notify_remove (priv->gconf_client,
+                                                                 priv->current_view_notify), 0);
       priv->gconf_client = (g_object_unref (priv->gconf_client), NULL);
     }
 
   if (priv->thread_pool)
     priv->thread_pool = (g_object_unref (priv->thread_pool), NULL);
 
+  if (priv->render_cache)
+    priv->render_cache = (g_object_unref (priv->render_cache), NULL);
+
+  g_queue_foreach (&priv->prerendered,
+                   (GFunc) prerendered_image_free,
+                   NULL);
+  g_queue_clear (&priv->prerendered);
+
   if (priv->info)
     priv->info = (g_object_unref (priv->info), NULL);
 
@@ -961,10 +1393,105 @@ hd_backgrounds_get_background (HDBackgrounds *backgrounds,
                                       view);
 }
 
+static void
+cancel_job (GCancellable *cancellable,
+            GCancellable *job_cancellable)
+{
+  g_cancellable_cancel (job_cancellable);
+}
+
+/**
+ * hd_backgrounds_job_cancellable_new:
+ * @cancellable: a #GCancellable or %NULL
+ *
+ * Creates the cancellable for one create cached image command. It is
+ * cancelled together with @cancellable, but also alone when the command
+ * is superseded by a newer one for the same view.
+ *
+ * Returns: a new #GCancellable
+ */
+GCancellable *
+hd_backgrounds_job_cancellable_new (GCancellable *cancellable)
+{
+  GCancellable *job_cancellable = g_cancellable_new ();
+
+  if (cancellable)
+    g_cancellable_connect (cancellable,
+                           G_CALLBACK (cancel_job),
+                           g_object_ref (job_cancellable),
+                           g_object_unref);
+
+  return job_cancellable;
+}
+
+/* A command for all views replaces the landscape images of each view */
+static inline gboolean
+request_supersedes (guint new_view,
+                    guint old_view)
+{
+  return new_view == old_view ||
+         (new_view == HD_BACKGROUNDS_ALL_VIEWS && old_view < HD_DESKTOP_VIEWS);
+}
+
+/*
+ * Cancels and drops older commands for the same view. Returns FALSE if an
+ * identical command is still pending, the new one is not needed then.
+ */
+static gboolean
+supersede_requests (HDBackgrounds *backgrounds,
+                    GFile         *source_file,
+                    guint          view,
+                    gboolean       error_dialogs,
+                    gboolean       update_gconf)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  guint i;
+
+  for (i = 0; i < priv->requests->len; i++)
+    {
+      CacheImageRequestData *request = g_ptr_array_index (priv->requests, i);
+
+      if (g_cancellable_is_cancelled (request->cancellable) ||
+          !request_supersedes (view, request->view))
+        continue;
+
+      if (request->view == view &&
+          request->error_dialogs == error_dialogs &&
+          request->update_gconf == update_gconf &&
+          g_file_equal (request->file, source_file))
+        return FALSE;
+
+      g_cancellable_cancel (request->cancellable);
+      hd_command_thread_pool_remove (priv->thread_pool,
+                                     request->command_id);
+    }
+
+  return TRUE;
+}
+
+/**
+ * hd_backgrounds_add_create_cached_image:
+ * @backgrounds: the #HDBackgrounds
+ * @source_file: the background image
+ * @view: the view or %HD_BACKGROUNDS_ALL_VIEWS
+ * @error_dialogs: whether @command shows error banners
+ * @update_gconf: whether @command stores @source_file in GConf
+ * @cancellable: the cancellable of @command from
+ *   hd_backgrounds_job_cancellable_new()
+ * @command: the command creating the cached image
+ * @data: data for @command
+ * @destroy_data: destroy notify for @data
+ *
+ * Queues @command. Older pending commands for @view are cancelled and
+ * dropped, if an identical command is pending already @command is dropped
+ * instead.
+ */
 void
 hd_backgrounds_add_create_cached_image (HDBackgrounds     *backgrounds,
                                         GFile             *source_file,
+                                        guint              view,
                                         gboolean           error_dialogs,
+                                        gboolean           update_gconf,
                                         GCancellable      *cancellable,
                                         HDCommandCallback  command,
                                         gpointer           data,
@@ -974,19 +1501,50 @@ hd_backgrounds_add_create_cached_image (HDBackgrounds     *backgrounds,
   CacheImageRequestData *request;
 
   g_return_if_fail (HD_IS_BACKGROUNDS (backgrounds));
+  g_return_if_fail (G_IS_CANCELLABLE (cancellable));
 
   priv = backgrounds->priv;
 
+  /* The speculative render is not needed anymore, a running one is still
+   * joined through the shared source */
+  if (priv->prerender_command_id)
+    {
+      hd_command_thread_pool_remove (priv->thread_pool,
+                                     priv->prerender_command_id);
+      priv->prerender_command_id = 0;
+    }
+
+  if (!supersede_requests (backgrounds,
+                           source_file,
+                           view,
+                           error_dialogs,
+                           update_gconf))
+    {
+      g_debug ("%s. Merged with pending request for view %u",
+               __FUNCTION__,
+               view);
+
+      if (destroy_data)
+        destroy_data (data);
+
+      return;
+    }
+
   request = cache_image_request_data_new (source_file,
+                                          view,
                                           error_dialogs,
+                                          update_gconf,
                                           cancellable);
   g_ptr_array_add (priv->requests,
                    request);
 
-  hd_command_thread_pool_push (priv->thread_pool,
-                               command,
-                               data,
-                               destroy_data);
+  request->command_id = hd_command_thread_pool_push_full (priv->thread_pool,
+                                                          get_priority_for_view (backgrounds,
+                                                                                 view),
+                                                          "cached-image",
+                                                          command,
+                                                          data,
+                                                          destroy_data);
 
   hd_command_thread_pool_push_idle (priv->thread_pool,
                                     G_PRIORITY_HIGH_IDLE,
@@ -1016,20 +1574,35 @@ typedef struct
 } UpdateCacheInfoData;
 
 static gboolean
-update_cache_info_file_idle (UpdateCacheInfoData *data)
+update_cache_info_file_idle (HDBackgrounds *backgrounds)
 {
-  HDBackgrounds *backgrounds = data->backgrounds;
   HDBackgroundsPrivate *priv = backgrounds->priv;
+  GQueue updates;
+  UpdateCacheInfoData *data;
+
+  g_mutex_lock (&priv->info_mutex);
+  updates = priv->info_updates;
+  g_queue_init (&priv->info_updates);
+  priv->info_updates_idle_id = 0;
+  g_mutex_unlock (&priv->info_mutex);
 
-  hd_background_info_set (priv->info,
-                          data->view,
-                          data->file,
-                          data->etag);
+  /* Write the info file once for all views updated meanwhile */
+  hd_background_info_freeze (priv->info);
 
-  g_object_unref (data->file);
-  g_free (data->etag);
+  while ((data = g_queue_pop_head (&updates)))
+    {
+      hd_background_info_set (priv->info,
+                              data->view,
+                              data->file,
+                              data->etag);
+
+      g_object_unref (data->file);
+      g_free (data->etag);
+
+      g_slice_free (UpdateCacheInfoData, data);
+    }
 
-  g_slice_free (UpdateCacheInfoData, data);
+  hd_background_info_thaw (priv->info);
 
   return FALSE;
 }
@@ -1047,45 +1620,338 @@ update_cache_info_file (HDBackgrounds *backgrounds,
   data->file = g_object_ref (file);
   data->etag = g_strdup (etag);
 
-  gdk_threads_add_idle_full (G_PRIORITY_HIGH_IDLE,
-                             (GSourceFunc) update_cache_info_file_idle,
-                             data,
-                             NULL);
+  g_mutex_lock (&backgrounds->priv->info_mutex);
+
+  g_queue_push_tail (&backgrounds->priv->info_updates, data);
+
+  if (!backgrounds->priv->info_updates_idle_id)
+    backgrounds->priv->info_updates_idle_id =
+      gdk_threads_add_idle_full (G_PRIORITY_HIGH_IDLE,
+                                 (GSourceFunc) update_cache_info_file_idle,
+                                 backgrounds,
+                                 NULL);
+
+  g_mutex_unlock (&backgrounds->priv->info_mutex);
 }
 
-gboolean
-hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
-                                  GdkPixbuf      *pixbuf,
-                                  guint           view,
-                                  GFile          *source_file,
-                                  const char     *source_etag,
-                                  gboolean        error_dialogs,
-                                  gboolean        update_gconf,
-                                  GCancellable   *cancellable,
-                                  GError        **error)
+/*
+ * Hard links the cached image already saved from @pixbuf for another view
+ * to @dest_filename. Returns FALSE if the image has to be saved, the caller
+ * must call finish_saved_image() then.
+ */
+static gboolean
+link_saved_image (HDBackgroundsSource *source,
+                  GdkPixbuf           *pixbuf,
+                  const gchar         *dest_filename)
+{
+  static gint link_counter = 0;
+  gchar *saved_path, *tmp_filename;
+  dev_t saved_dev;
+  ino_t saved_ino;
+  struct stat st;
+  gboolean linked = FALSE;
+
+  g_mutex_lock (&source->mutex);
+
+  while (source->saving)
+    g_cond_wait (&source->cond, &source->mutex);
+
+  if (!source->saved_path || source->pixbuf != pixbuf)
+    {
+      source->saving = TRUE;
+      g_mutex_unlock (&source->mutex);
+      return FALSE;
+    }
+
+  saved_path = g_strdup (source->saved_path);
+  saved_dev = source->saved_dev;
+  saved_ino = source->saved_ino;
+
+  g_mutex_unlock (&source->mutex);
+
+  tmp_filename = g_strdup_printf ("%s.%d",
+                                  dest_filename,
+                                  g_atomic_int_add (&link_counter, 1));
+  g_unlink (tmp_filename);
+
+  /* The saved file may have been replaced by a newer image meanwhile */
+  if (link (saved_path, tmp_filename) == 0)
+    {
+      if (g_stat (tmp_filename, &st) == 0 &&
+          st.st_dev == saved_dev &&
+          st.st_ino == saved_ino &&
+          g_rename (tmp_filename, dest_filename) == 0)
+        linked = TRUE;
+      else
+        g_unlink (tmp_filename);
+    }
+  else
+    g_debug ("%s. Could not link %s. %s",
+             __FUNCTION__,
+             saved_path,
+             g_strerror (errno));
+
+  if (linked)
+    g_debug ("%s. Linked %s to %s", __FUNCTION__, saved_path, dest_filename);
+  else
+    {
+      g_mutex_lock (&source->mutex);
+      while (source->saving)
+        g_cond_wait (&source->cond, &source->mutex);
+      source->saving = TRUE;
+      g_mutex_unlock (&source->mutex);
+    }
+
+  g_free (tmp_filename);
+  g_free (saved_path);
+
+  return linked;
+}
+
+static void
+finish_saved_image (HDBackgroundsSource *source,
+                    GdkPixbuf           *pixbuf,
+                    const gchar         *dest_filename,
+                    gboolean             saved)
+{
+  struct stat st;
+
+  g_mutex_lock (&source->mutex);
+
+  if (saved &&
+      source->pixbuf == pixbuf &&
+      g_stat (dest_filename, &st) == 0)
+    {
+      g_free (source->saved_path);
+      source->saved_path = g_strdup (dest_filename);
+      source->saved_dev = st.st_dev;
+      source->saved_ino = st.st_ino;
+    }
+
+  source->saving = FALSE;
+  g_cond_broadcast (&source->cond);
+
+  g_mutex_unlock (&source->mutex);
+}
+
+static gchar *
+get_cached_image_filename (guint view)
+{
+  if (view >= HD_DESKTOP_VIEWS)
+    return g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG_PORTRAIT,
+                            g_get_home_dir (),
+                            (view - HD_DESKTOP_VIEWS) + 1);
+
+  return g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG,
+                          g_get_home_dir (),
+                          view + 1);
+}
+
+/* Records @source_file as the background of @view once its cached image
+ * is in place */
+static void
+set_cached_image_source (HDBackgrounds *backgrounds,
+                         guint          view,
+                         GFile         *source_file,
+                         const char    *source_etag,
+                         gboolean       update_gconf)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GError *error = NULL;
+
+  update_cache_info_file (backgrounds,
+                          view,
+                          source_file,
+                          source_etag);
+
+  /* Update GConf if requested */
+  if (update_gconf)
+    {
+      gchar *gconf_key, *path;
+
+      path = g_file_get_path (source_file);
+
+      /* Store background to GConf */
+      gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, view + 1);
+      gconf_client_set_string (priv->gconf_client,
+                               gconf_key,
+                               path,
+                               &error);
+
+      if (error)
+        {
+          g_debug ("%s. Could not set background in GConf for view %u. %s",
+                   __FUNCTION__,
+                   view,
+                   error->message);
+          g_clear_error (&error);
+        }
+
+      g_free (gconf_key);
+      g_free (path);
+    }
+}
+
+static gchar *
+get_preview_backup_filename (guint view)
+{
+  gchar *dest_filename, *backup_filename;
+
+  dest_filename = get_cached_image_filename (view);
+  backup_filename = g_strconcat (dest_filename, PREVIEW_BACKUP_SUFFIX, NULL);
+  g_free (dest_filename);
+
+  return backup_filename;
+}
+
+/* Puts back the cached images replaced by previews if hildon-home did not
+ * finish rendering them */
+static void
+restore_interrupted_previews (void)
+{
+  guint view;
+
+  for (view = 0; view < HD_DESKTOP_VIEWS * 2; view++)
+    {
+      gchar *backup_filename = get_preview_backup_filename (view);
+
+      if (g_file_test (backup_filename, G_FILE_TEST_EXISTS))
+        {
+          gchar *dest_filename = get_cached_image_filename (view);
+
+          g_debug ("%s. Restore %s", __FUNCTION__, dest_filename);
+
+          g_rename (backup_filename, dest_filename);
+
+          g_free (dest_filename);
+        }
+
+      g_free (backup_filename);
+    }
+}
+
+/*
+ * Called with the lock of @view held when the job of @cancellable is done
+ * with the cached image of @view. If its preview is still shown it is
+ * replaced by the image before the preview, unless @saved.
+ */
+static void
+finish_preview (HDBackgrounds *backgrounds,
+                guint          view,
+                GCancellable  *cancellable,
+                gboolean       saved)
+{
+  CachedImageState *state = &backgrounds->priv->cached_images[view];
+  gchar *dest_filename, *backup_filename;
+  struct stat st;
+
+  if (!cancellable || state->preview_owner != cancellable)
+    return;
+
+  dest_filename = get_cached_image_filename (view);
+  backup_filename = get_preview_backup_filename (view);
+
+  if (!saved &&
+      g_stat (dest_filename, &st) == 0 &&
+      st.st_dev == state->preview_dev &&
+      st.st_ino == state->preview_ino)
+    {
+      g_debug ("%s. Remove preview of view %u", __FUNCTION__, view);
+
+      if (state->has_backup)
+        g_rename (backup_filename, dest_filename);
+      else
+        g_unlink (dest_filename);
+    }
+  else if (state->has_backup)
+    g_unlink (backup_filename);
+
+  state->preview_owner = (g_object_unref (state->preview_owner), NULL);
+  state->has_backup = FALSE;
+
+  g_free (backup_filename);
+  g_free (dest_filename);
+}
+
+static gboolean
+save_cached_image (HDBackgrounds        *backgrounds,
+                   HDBackgroundsSource  *source,
+                   GdkPixbuf            *pixbuf,
+                   guint                 view,
+                   GFile                *source_file,
+                   const char           *source_etag,
+                   gboolean              error_dialogs,
+                   gboolean              update_gconf,
+                   GCancellable         *cancellable,
+                   GError              **error)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
   char *dest_filename;
   GFile *dest_file;
+  gboolean saved, cancelled;
   GError *local_error = NULL;
 
+  g_return_val_if_fail (view < G_N_ELEMENTS (priv->cached_images), FALSE);
+
   /* Create the file objects for the cached background image */
-  if(view >= HD_DESKTOP_VIEWS)
-    dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG_PORTRAIT,
-                                     g_get_home_dir (),
-                                     (view - HD_DESKTOP_VIEWS) + 1);
-  else
-    dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG,
-                                     g_get_home_dir (),
-                                     view + 1);
+  dest_filename = get_cached_image_filename (view);
   dest_file = g_file_new_for_path (dest_filename);
 
-  /* Create the cached background image */
-  if (!hd_pixbuf_utils_save (dest_file,
-                             pixbuf,
-                             "png",
-                             cancellable,
-                             &local_error))
+  g_mutex_lock (&priv->cached_images[view].mutex);
+
+  /* Reuse the image of another view rendered from the same source */
+  if (source &&
+      link_saved_image (source, pixbuf, dest_filename))
+    saved = TRUE;
+  else
+    {
+      /* Create the cached background image */
+      saved = hd_pixbuf_utils_save (dest_file,
+                                    pixbuf,
+                                    "png",
+                                    cancellable,
+                                    &local_error);
+
+      if (source)
+        finish_saved_image (source,
+                            pixbuf,
+                            dest_filename,
+                            saved && !g_cancellable_is_cancelled (cancellable));
+    }
+
+  /* The preview is replaced or restored now */
+  finish_preview (backgrounds,
+                  view,
+                  cancellable,
+                  saved);
+
+  /* Superseded while saving, the newer command updates info and GConf.
+   * Checked under the lock so a cancelled command never records the
+   * image a newer command already wrote */
+  cancelled = saved && g_cancellable_is_cancelled (cancellable);
+
+  /* Keep the rendered image, switching back to this background later
+   * only links it. Only images rendered from a source are scaled and
+   * cropped from the whole image, wallpaper slices are not cached */
+  if (saved && !cancelled && source && source_etag)
+    {
+      HDImageSize size = {gdk_pixbuf_get_width (pixbuf),
+                          gdk_pixbuf_get_height (pixbuf)};
+      gchar *uri = g_file_get_uri (source_file);
+
+      hd_render_cache_insert (priv->render_cache,
+                              uri,
+                              source_etag,
+                              &size,
+                              view >= HD_DESKTOP_VIEWS,
+                              dest_filename);
+
+      g_free (uri);
+    }
+
+  g_mutex_unlock (&priv->cached_images[view].mutex);
+
+  if (!saved)
     {
       /* Display not enough space notification banner */
       if (error_dialogs &&
@@ -1102,45 +1968,623 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
       g_propagate_error (error,
                          local_error);
 
+      g_free (dest_filename);
+      g_object_unref (dest_file);
+
       return FALSE;
     }
 
-  g_free (dest_filename);
   g_object_unref (dest_file);
 
-  update_cache_info_file (backgrounds,
-                          view,
-                          source_file,
-                          source_etag);
+  if (cancelled)
+    {
+      g_cancellable_set_error_if_cancelled (cancellable, error);
+      g_free (dest_filename);
+      return FALSE;
+    }
 
-  /* Update GConf if requested */
-  if (update_gconf)
+  g_free (dest_filename);
+
+  set_cached_image_source (backgrounds,
+                           view,
+                           source_file,
+                           source_etag,
+                           update_gconf);
+
+  return TRUE;
+}
+
+gboolean
+hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
+                                  GdkPixbuf      *pixbuf,
+                                  guint           view,
+                                  GFile          *source_file,
+                                  const char     *source_etag,
+                                  gboolean        error_dialogs,
+                                  gboolean        update_gconf,
+                                  GCancellable   *cancellable,
+                                  GError        **error)
+{
+  return save_cached_image (backgrounds,
+                            NULL,
+                            pixbuf,
+                            view,
+                            source_file,
+                            source_etag,
+                            error_dialogs,
+                            update_gconf,
+                            cancellable,
+                            error);
+}
+
+/**
+ * hd_backgrounds_source_save_cached_image:
+ * @source: the #HDBackgroundsSource @pixbuf was loaded from
+ * @pixbuf: the image from hd_backgrounds_source_load_scaled_and_cropped()
+ * @view: the view
+ * @source_etag: the etag of the source image
+ * @error_dialogs: whether to show error banners
+ * @update_gconf: whether to store the source in GConf
+ * @cancellable: a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Like hd_backgrounds_save_cached_image(), but if the same image was
+ * already saved for another view the cached file is linked instead of
+ * encoded again.
+ */
+gboolean
+hd_backgrounds_source_save_cached_image (HDBackgroundsSource  *source,
+                                         GdkPixbuf            *pixbuf,
+                                         guint                 view,
+                                         const char           *source_etag,
+                                         gboolean              error_dialogs,
+                                         gboolean              update_gconf,
+                                         GCancellable         *cancellable,
+                                         GError              **error)
+{
+  return save_cached_image (source->backgrounds,
+                            source,
+                            pixbuf,
+                            view,
+                            source->file,
+                            source_etag,
+                            error_dialogs,
+                            update_gconf,
+                            cancellable,
+                            error);
+}
+
+/* Returns the current etag of @file or %NULL */
+static gchar *
+query_etag (GFile        *file,
+            GCancellable *cancellable)
+{
+  GFileInfo *info;
+  gchar *etag;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_ETAG_VALUE,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            NULL);
+  if (!info)
+    return NULL;
+
+  etag = g_strdup (g_file_info_get_etag (info));
+  g_object_unref (info);
+
+  return etag;
+}
+
+/**
+ * hd_backgrounds_source_link_rendered_image:
+ * @source: a #HDBackgroundsSource
+ * @size: the size of the cached image
+ * @view: the view
+ * @update_gconf: whether to store the source in GConf
+ * @cancellable: a #GCancellable
+ *
+ * Uses the image rendered earlier from the current version of @source at
+ * @size as cached image of @view, if it is still in the render cache.
+ *
+ * Returns: %TRUE if the cached image was linked, %FALSE if it has to be
+ *   rendered
+ */
+gboolean
+hd_backgrounds_source_link_rendered_image (HDBackgroundsSource *source,
+                                           HDImageSize         *size,
+                                           guint                view,
+                                           gboolean             update_gconf,
+                                           GCancellable        *cancellable)
+{
+  HDBackgroundsPrivate *priv = source->backgrounds->priv;
+  gchar *etag, *dest_filename;
+  gboolean linked;
+  gint64 start_time;
+
+  if (g_cancellable_is_cancelled (cancellable) ||
+      view >= G_N_ELEMENTS (priv->cached_images))
+    return FALSE;
+
+  start_time = g_get_monotonic_time ();
+
+  etag = query_etag (source->file, cancellable);
+  if (!etag)
+    return FALSE;
+
+  dest_filename = get_cached_image_filename (view);
+
+  g_mutex_lock (&priv->cached_images[view].mutex);
+
+  linked = hd_render_cache_lookup (priv->render_cache,
+                                   source->uri,
+                                   etag,
+                                   size,
+                                   view >= HD_DESKTOP_VIEWS,
+                                   dest_filename);
+
+  g_mutex_unlock (&priv->cached_images[view].mutex);
+
+  g_free (dest_filename);
+
+  if (linked)
     {
-      gchar *gconf_key, *path;
+      hd_command_thread_pool_record_phase ("link", start_time);
+
+      /* Superseded meanwhile, the newer command updates info and GConf */
+      if (!g_cancellable_is_cancelled (cancellable))
+        set_cached_image_source (source->backgrounds,
+                                 view,
+                                 source->file,
+                                 etag,
+                                 update_gconf);
+    }
 
-      path = g_file_get_path (source_file);
+  g_free (etag);
 
-      /* Store background to GConf */
-      gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, view + 1);
-      gconf_client_set_string (priv->gconf_client,
-                               gconf_key,
-                               path,
-                               &local_error);
+  return linked;
+}
+
+static void
+prerendered_image_free (PrerenderedImage *image)
+{
+  g_free (image->uri);
+  g_free (image->etag);
+  g_object_unref (image->pixbuf);
+
+  g_slice_free (PrerenderedImage, image);
+}
+
+/* Called with prerendered_mutex locked */
+static GList *
+find_prerendered_image (HDBackgroundsPrivate *priv,
+                        const gchar          *uri,
+                        guint                 view,
+                        const gchar          *etag,
+                        HDImageSize          *size)
+{
+  GList *l;
+
+  for (l = priv->prerendered.head; l; l = l->next)
+    {
+      PrerenderedImage *image = l->data;
+
+      if (image->view == view &&
+          g_strcmp0 (image->uri, uri) == 0 &&
+          g_strcmp0 (image->etag, etag) == 0 &&
+          gdk_pixbuf_get_width (image->pixbuf) == size->width &&
+          gdk_pixbuf_get_height (image->pixbuf) == size->height)
+        return l;
+    }
+
+  return NULL;
+}
+
+static void
+prerender_data_free (PrerenderData *data)
+{
+  hd_backgrounds_source_unref (data->source);
+  g_object_unref (data->cancellable);
+
+  g_slice_free (PrerenderData, data);
+}
+
+static void
+prerender_command (PrerenderData *data)
+{
+  HDBackgrounds *backgrounds = data->source->backgrounds;
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  HDImageSize size = {HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT};
+  PrerenderedImage *image;
+  GdkPixbuf *pixbuf;
+  gchar *etag;
+  gboolean found;
+  GError *error = NULL;
+
+  if (g_cancellable_is_cancelled (data->cancellable))
+    goto cleanup;
+
+  etag = query_etag (data->source->file, data->cancellable);
+  if (!etag)
+    goto cleanup;
+
+  /* Already rendered, applying it only links the cached image */
+  g_mutex_lock (&priv->prerendered_mutex);
+  found = find_prerendered_image (priv,
+                                  data->source->uri,
+                                  data->view,
+                                  etag,
+                                  &size) != NULL;
+  g_mutex_unlock (&priv->prerendered_mutex);
+
+  if (found ||
+      hd_render_cache_contains (priv->render_cache,
+                                data->source->uri,
+                                etag,
+                                &size,
+                                data->view >= HD_DESKTOP_VIEWS))
+    {
+      g_free (etag);
+      goto cleanup;
+    }
+
+  g_free (etag);
+  etag = NULL;
+
+  pixbuf = hd_backgrounds_source_load_scaled_and_cropped (data->source,
+                                                          &size,
+                                                          &etag,
+                                                          data->cancellable,
+                                                          &error);
+  if (error)
+    {
+      g_debug ("%s. Could not prerender %s. %s",
+               __FUNCTION__,
+               data->source->uri,
+               error->message);
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        hd_command_thread_pool_command_failed ();
+      g_error_free (error);
+      goto cleanup;
+    }
+
+  if (!pixbuf)
+    goto cleanup;
+
+  image = g_slice_new0 (PrerenderedImage);
+  image->uri = g_strdup (data->source->uri);
+  image->view = data->view;
+  image->etag = etag;
+  image->pixbuf = pixbuf;
+
+  g_mutex_lock (&priv->prerendered_mutex);
+
+  g_queue_push_head (&priv->prerendered, image);
+  while (g_queue_get_length (&priv->prerendered) > PRERENDERED_IMAGES)
+    prerendered_image_free (g_queue_pop_tail (&priv->prerendered));
+
+  g_mutex_unlock (&priv->prerendered_mutex);
+
+  g_debug ("%s. Prerendered %s for view %u",
+           __FUNCTION__,
+           data->source->uri,
+           data->view);
+
+cleanup:
+  if (g_cancellable_is_cancelled (data->cancellable))
+    hd_command_thread_pool_command_cancelled ();
+}
 
-      if (local_error)
+/**
+ * hd_backgrounds_prerender:
+ * @backgrounds: the #HDBackgrounds
+ * @file: the background image which will probably be applied
+ * @view: the view it would be applied to
+ * @cancellable: a #GCancellable to stop the render or %NULL
+ *
+ * Renders @file for @view ahead at speculative priority, so applying it
+ * later does not have to decode it anymore. A previous prerender which
+ * did not start yet is dropped.
+ */
+void
+hd_backgrounds_prerender (HDBackgrounds *backgrounds,
+                          GFile         *file,
+                          guint          view,
+                          GCancellable  *cancellable)
+{
+  HDBackgroundsPrivate *priv;
+  PrerenderData *data;
+
+  g_return_if_fail (HD_IS_BACKGROUNDS (backgrounds));
+  g_return_if_fail (G_IS_FILE (file));
+
+  priv = backgrounds->priv;
+
+  if (priv->prerender_command_id)
+    hd_command_thread_pool_remove (priv->thread_pool,
+                                   priv->prerender_command_id);
+
+  data = g_slice_new0 (PrerenderData);
+  data->source = hd_backgrounds_source_ref (backgrounds, file);
+  data->view = view;
+  data->cancellable = cancellable ? g_object_ref (cancellable) : g_cancellable_new ();
+
+  priv->prerender_command_id = hd_command_thread_pool_push_full (priv->thread_pool,
+                                                                 HD_COMMAND_PRIORITY_SPECULATIVE,
+                                                                 "prerender",
+                                                                 (HDCommandCallback) prerender_command,
+                                                                 data,
+                                                                 (GDestroyNotify) prerender_data_free);
+}
+
+/**
+ * hd_backgrounds_source_get_prerendered:
+ * @source: a #HDBackgroundsSource
+ * @view: the view
+ * @size: the size of the cached image
+ * @etag: return location for the etag of the source image
+ *
+ * Returns the image rendered from the current version of @source for
+ * @view by hd_backgrounds_prerender(), if there is one.
+ *
+ * Returns: a new reference to the image or %NULL
+ */
+GdkPixbuf *
+hd_backgrounds_source_get_prerendered (HDBackgroundsSource  *source,
+                                       guint                 view,
+                                       HDImageSize          *size,
+                                       char                **etag)
+{
+  HDBackgroundsPrivate *priv = source->backgrounds->priv;
+  GdkPixbuf *pixbuf = NULL;
+  gchar *current_etag;
+  GList *l;
+
+  /* Checked without a query if nothing was prerendered */
+  g_mutex_lock (&priv->prerendered_mutex);
+  l = priv->prerendered.head;
+  g_mutex_unlock (&priv->prerendered_mutex);
+
+  if (!l)
+    return NULL;
+
+  current_etag = query_etag (source->file, NULL);
+  if (!current_etag)
+    return NULL;
+
+  g_mutex_lock (&priv->prerendered_mutex);
+
+  l = find_prerendered_image (priv,
+                              source->uri,
+                              view,
+                              current_etag,
+                              size);
+  if (l)
+    {
+      PrerenderedImage *image = l->data;
+
+      pixbuf = g_object_ref (image->pixbuf);
+    }
+
+  g_mutex_unlock (&priv->prerendered_mutex);
+
+  if (pixbuf)
+    {
+      g_debug ("%s. Use prerendered %s", __FUNCTION__, source->uri);
+
+      if (etag)
+        *etag = current_etag;
+      else
+        g_free (current_etag);
+    }
+  else
+    g_free (current_etag);
+
+  return pixbuf;
+}
+
+/**
+ * hd_backgrounds_source_is_decoded:
+ * @source: a #HDBackgroundsSource
+ * @size: the size of the cached image
+ *
+ * Checks if @source is already decoded at @size, so
+ * hd_backgrounds_source_load_scaled_and_cropped() returns immediately.
+ *
+ * Returns: %TRUE if the decoded image can be reused
+ */
+gboolean
+hd_backgrounds_source_is_decoded (HDBackgroundsSource *source,
+                                  HDImageSize         *size)
+{
+  gboolean decoded;
+
+  g_mutex_lock (&source->mutex);
+  decoded = source->pixbuf &&
+            source->size.width == size->width &&
+            source->size.height == size->height;
+  g_mutex_unlock (&source->mutex);
+
+  return decoded;
+}
+
+/**
+ * hd_backgrounds_source_publish_preview:
+ * @source: a #HDBackgroundsSource
+ * @size: the size of the cached image
+ * @view: the view
+ * @cancellable: the #GCancellable of the job
+ *
+ * Shows a low quality version of a large @source as cached image of the
+ * visible @view until the job saves the real image. The job must call
+ * hd_backgrounds_source_finish_preview() when it is done, so a preview
+ * never stays if the job fails or is superseded.
+ *
+ * Returns: %TRUE if a preview was shown
+ */
+gboolean
+hd_backgrounds_source_publish_preview (HDBackgroundsSource *source,
+                                       HDImageSize         *size,
+                                       guint                view,
+                                       GCancellable        *cancellable)
+{
+  HDBackgroundsPrivate *priv = source->backgrounds->priv;
+  CachedImageState *state;
+  GdkPixbuf *pixbuf;
+  gchar *dest_filename, *backup_filename;
+  GFile *dest_file;
+  struct stat st;
+  gboolean published = FALSE;
+  gint64 start_time;
+  GError *error = NULL;
+
+  g_return_val_if_fail (G_IS_CANCELLABLE (cancellable), FALSE);
+
+  if (!priv->progressive_wallpaper ||
+      view >= G_N_ELEMENTS (priv->cached_images) ||
+      view % HD_DESKTOP_VIEWS != (guint) g_atomic_int_get (&priv->visible_view) ||
+      g_cancellable_is_cancelled (cancellable))
+    return FALSE;
+
+  start_time = g_get_monotonic_time ();
+
+  pixbuf = hd_pixbuf_utils_load_preview (source->file,
+                                         size,
+                                         cancellable,
+                                         &error);
+  if (!pixbuf)
+    {
+      if (error)
         {
-          g_debug ("%s. Could not set background in GConf for view %u. %s",
+          g_debug ("%s. Could not load preview of %s. %s",
                    __FUNCTION__,
-                   view,
-                   local_error->message);
-          g_clear_error (&local_error);
+                   source->uri,
+                   error->message);
+          g_error_free (error);
         }
+      return FALSE;
+    }
 
-      g_free (gconf_key);
-      g_free (path);
+  dest_filename = get_cached_image_filename (view);
+  backup_filename = get_preview_backup_filename (view);
+  dest_file = g_file_new_for_path (dest_filename);
+
+  state = &priv->cached_images[view];
+
+  g_mutex_lock (&state->mutex);
+
+  if (g_cancellable_is_cancelled (cancellable))
+    goto cleanup;
+
+  /* The preview of another job was replaced by a real image meanwhile */
+  if (state->preview_owner &&
+      !(g_stat (dest_filename, &st) == 0 &&
+        st.st_dev == state->preview_dev &&
+        st.st_ino == state->preview_ino))
+    finish_preview (source->backgrounds,
+                    view,
+                    state->preview_owner,
+                    TRUE);
+
+  /* Replacing the preview of a superseded job keeps its backup */
+  if (!state->preview_owner)
+    {
+      g_unlink (backup_filename);
+
+      if (link (dest_filename, backup_filename) == 0)
+        state->has_backup = TRUE;
+      else if (errno != ENOENT)
+        {
+          g_debug ("%s. Could not back up %s. %s",
+                   __FUNCTION__,
+                   dest_filename,
+                   g_strerror (errno));
+          goto cleanup;
+        }
     }
 
-  return TRUE;
+  /* Stored uncompressed, it is replaced soon anyway */
+  if (hd_pixbuf_utils_save_png (dest_file,
+                                pixbuf,
+                                0,
+                                HD_PNG_FILTER_NONE,
+                                NULL,
+                                &error) &&
+      g_stat (dest_filename, &st) == 0)
+    {
+      if (state->preview_owner)
+        g_object_unref (state->preview_owner);
+
+      state->preview_owner = g_object_ref (cancellable);
+      state->preview_dev = st.st_dev;
+      state->preview_ino = st.st_ino;
+
+      published = TRUE;
+    }
+  else
+    {
+      if (error)
+        {
+          g_debug ("%s. Could not save preview. %s",
+                   __FUNCTION__,
+                   error->message);
+          g_clear_error (&error);
+        }
+
+      /* The cached image was not replaced */
+      if (!state->preview_owner && state->has_backup)
+        {
+          g_unlink (backup_filename);
+          state->has_backup = FALSE;
+        }
+    }
+
+cleanup:
+  g_mutex_unlock (&state->mutex);
+
+  if (published)
+    {
+      hd_command_thread_pool_record_phase ("preview", start_time);
+      g_debug ("%s. Published preview of %s for view %u",
+               __FUNCTION__,
+               source->uri,
+               view);
+    }
+
+  g_object_unref (dest_file);
+  g_free (backup_filename);
+  g_free (dest_filename);
+  g_object_unref (pixbuf);
+
+  return published;
+}
+
+/**
+ * hd_backgrounds_source_finish_preview:
+ * @source: a #HDBackgroundsSource
+ * @view: the view
+ * @cancellable: the #GCancellable of the job
+ *
+ * Called at the end of a job which may have called
+ * hd_backgrounds_source_publish_preview(). If the job did not save the
+ * cached image of @view, the image shown before its preview is restored.
+ */
+void
+hd_backgrounds_source_finish_preview (HDBackgroundsSource *source,
+                                      guint                view,
+                                      GCancellable        *cancellable)
+{
+  HDBackgroundsPrivate *priv = source->backgrounds->priv;
+
+  if (view >= G_N_ELEMENTS (priv->cached_images))
+    return;
+
+  g_mutex_lock (&priv->cached_images[view].mutex);
+  finish_preview (source->backgrounds,
+                  view,
+                  cancellable,
+                  FALSE);
+  g_mutex_unlock (&priv->cached_images[view].mutex);
 }
 
 void
@@ -1154,15 +2598,268 @@ hd_backgrounds_report_corrupt_image (const GError *error)
     }
 }
 
+/**
+ * hd_backgrounds_source_ref:
+ * @backgrounds: the #HDBackgrounds
+ * @file: the background image
+ *
+ * Returns the shared source for @file. Commands which hold a reference to
+ * the same source decode the image only once. Must be called in the main
+ * thread when the command is queued.
+ *
+ * Returns: a #HDBackgroundsSource, release it with
+ *   hd_backgrounds_source_unref()
+ */
+HDBackgroundsSource *
+hd_backgrounds_source_ref (HDBackgrounds *backgrounds,
+                           GFile         *file)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  HDBackgroundsSource *source;
+  gchar *uri;
+
+  uri = g_file_get_uri (file);
+
+  g_mutex_lock (&priv->sources_mutex);
+
+  source = g_hash_table_lookup (priv->sources, uri);
+  if (source)
+    {
+      source->ref_count++;
+      g_free (uri);
+    }
+  else
+    {
+      source = g_slice_new0 (HDBackgroundsSource);
+
+      source->backgrounds = backgrounds;
+      source->ref_count = 1;
+      source->uri = uri;
+      source->file = g_object_ref (file);
+      g_mutex_init (&source->mutex);
+      g_cond_init (&source->cond);
+
+      g_hash_table_insert (priv->sources, source->uri, source);
+    }
+
+  g_mutex_unlock (&priv->sources_mutex);
+
+  return source;
+}
+
+/**
+ * hd_backgrounds_source_unref:
+ * @source: a #HDBackgroundsSource
+ *
+ * Releases a reference to @source, can be called from any thread. The
+ * decoded image is freed with the last reference.
+ */
+void
+hd_backgrounds_source_unref (HDBackgroundsSource *source)
+{
+  HDBackgroundsPrivate *priv;
+
+  if (!source)
+    return;
+
+  priv = source->backgrounds->priv;
+
+  g_mutex_lock (&priv->sources_mutex);
+
+  if (--source->ref_count > 0)
+    {
+      g_mutex_unlock (&priv->sources_mutex);
+      return;
+    }
+
+  g_hash_table_remove (priv->sources, source->uri);
+
+  g_mutex_unlock (&priv->sources_mutex);
+
+  if (source->pixbuf)
+    g_object_unref (source->pixbuf);
+  g_free (source->etag);
+  g_free (source->saved_path);
+  g_object_unref (source->file);
+  g_free (source->uri);
+  g_cond_clear (&source->cond);
+  g_mutex_clear (&source->mutex);
+
+  g_slice_free (HDBackgroundsSource, source);
+}
+
+/* Estimates the memory needed to decode @file from its header */
+static gsize
+estimate_decode_memory (GFile *file)
+{
+  gchar *path;
+  gint width = 0, height = 0;
+
+  path = g_file_get_path (file);
+  if (path)
+    gdk_pixbuf_get_file_info (path, &width, &height);
+  g_free (path);
+
+  if (width <= 0 || height <= 0)
+    return DEFAULT_DECODE_MEMORY;
+
+  return (gsize) width * height * 4;
+}
+
+/*
+ * Waits until @bytes fit into the decode memory budget. An image bigger
+ * than the whole budget is decoded when no other image is decoded.
+ */
+static gboolean
+reserve_decode_memory (HDBackgrounds  *backgrounds,
+                       gsize           bytes,
+                       GCancellable   *cancellable,
+                       GError        **error)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  g_mutex_lock (&priv->decode_memory_mutex);
+
+  while (priv->decode_memory > 0 &&
+         priv->decode_memory + bytes > DECODE_MEMORY_BUDGET)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          g_mutex_unlock (&priv->decode_memory_mutex);
+          return FALSE;
+        }
+
+      g_cond_wait_until (&priv->decode_memory_cond,
+                         &priv->decode_memory_mutex,
+                         g_get_monotonic_time () + 100 * G_TIME_SPAN_MILLISECOND);
+    }
+
+  priv->decode_memory += bytes;
+
+  g_mutex_unlock (&priv->decode_memory_mutex);
+
+  return TRUE;
+}
+
+static void
+release_decode_memory (HDBackgrounds *backgrounds,
+                       gsize          bytes)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  g_mutex_lock (&priv->decode_memory_mutex);
+  priv->decode_memory -= bytes;
+  g_cond_broadcast (&priv->decode_memory_cond);
+  g_mutex_unlock (&priv->decode_memory_mutex);
+}
+
+/**
+ * hd_backgrounds_source_load_scaled_and_cropped:
+ * @source: a #HDBackgroundsSource
+ * @size: the size of the cached image
+ * @etag: return location for the etag of the source image
+ * @cancellable: a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Like hd_pixbuf_utils_load_scaled_and_cropped(), but the image is decoded
+ * only once for all commands holding @source. If another command is
+ * decoding the same source, waits for its result.
+ *
+ * Returns: a new reference to the scaled image or %NULL on error
+ */
+GdkPixbuf *
+hd_backgrounds_source_load_scaled_and_cropped (HDBackgroundsSource  *source,
+                                               HDImageSize          *size,
+                                               char                **etag,
+                                               GCancellable         *cancellable,
+                                               GError              **error)
+{
+  GdkPixbuf *pixbuf;
+  char *loaded_etag = NULL;
+  gsize decode_memory;
+
+  g_mutex_lock (&source->mutex);
+
+  while (source->loading)
+    g_cond_wait (&source->cond, &source->mutex);
+
+  if (source->pixbuf &&
+      source->size.width == size->width &&
+      source->size.height == size->height)
+    {
+      pixbuf = g_object_ref (source->pixbuf);
+      if (etag)
+        *etag = g_strdup (source->etag);
+
+      g_mutex_unlock (&source->mutex);
+
+      g_debug ("%s. Reuse decoded %s", __FUNCTION__, source->uri);
+
+      return pixbuf;
+    }
+
+  source->loading = TRUE;
+
+  g_mutex_unlock (&source->mutex);
+
+  decode_memory = estimate_decode_memory (source->file);
+
+  if (reserve_decode_memory (source->backgrounds,
+                             decode_memory,
+                             cancellable,
+                             error))
+    {
+      pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (source->file,
+                                                        size,
+                                                        &loaded_etag,
+                                                        cancellable,
+                                                        error);
+
+      release_decode_memory (source->backgrounds,
+                             decode_memory);
+    }
+  else
+    pixbuf = NULL;
+
+  g_mutex_lock (&source->mutex);
+
+  /* A failed or cancelled load is retried by the next command */
+  if (pixbuf)
+    {
+      if (source->pixbuf)
+        g_object_unref (source->pixbuf);
+      source->pixbuf = g_object_ref (pixbuf);
+      source->size = *size;
+      g_free (source->etag);
+      source->etag = g_strdup (loaded_etag);
+    }
+
+  source->loading = FALSE;
+  g_cond_broadcast (&source->cond);
+
+  g_mutex_unlock (&source->mutex);
+
+  if (etag)
+    *etag = loaded_etag;
+  else
+    g_free (loaded_etag);
+
+  return pixbuf;
+}
+
 static CacheImageRequestData *
 cache_image_request_data_new (GFile        *file,
+                              guint         view,
                               gboolean      error_dialogs,
+                              gboolean      update_gconf,
                               GCancellable *cancellable)
 {
   CacheImageRequestData *data = g_slice_new0 (CacheImageRequestData);
 
   data->file = g_object_ref (file);
+  data->view = view;
   data->error_dialogs = error_dialogs;
+  data->update_gconf = update_gconf;
   if (cancellable)
     data->cancellable = g_object_ref (cancellable);
 
@@ -1189,6 +2886,7 @@ hd_backgrounds_set_current_background (HDBackgrounds *backgrounds,
                                        const char    *uri)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
+  BackgroundCheck *check;
   guint current_view;
   GFile *image_file;
   GError *error = NULL;
@@ -1217,11 +2915,14 @@ hd_backgrounds_set_current_background (HDBackgrounds *backgrounds,
 
   image_file = g_file_new_for_uri (uri);
 
-  create_cached_background (backgrounds,
-                            image_file,
-                            current_view,
-                            TRUE,
-                            TRUE);
+  check = background_check_new (backgrounds,
+                                TRUE,
+                                TRUE);
+  background_check_add (check,
+                        image_file,
+                        current_view);
+  background_check_run (check,
+                        FALSE);
 
   g_object_unref (image_file);
 }
@@ -26,6 +26,7 @@
 #include <gio/gio.h>
 
 #include "hd-command-thread-pool.h"
+#include "hd-pixbuf-utils.h"
 
 G_BEGIN_DECLS
 
@@ -39,6 +40,7 @@ G_BEGIN_DECLS
 typedef struct _HDBackgrounds        HDBackgrounds;
 typedef struct _HDBackgroundsClass   HDBackgroundsClass;
 typedef struct _HDBackgroundsPrivate HDBackgroundsPrivate;
+typedef struct _HDBackgroundsSource  HDBackgroundsSource;
 
 struct _HDBackgrounds 
 {
@@ -57,15 +59,24 @@ GType          hd_backgrounds_get_type        (void);
 HDBackgrounds *hd_backgrounds_get             (void);
 
 void           hd_backgrounds_startup         (HDBackgrounds  *backgrounds);
+void           hd_backgrounds_shutdown        (HDBackgrounds  *backgrounds);
 
 void           hd_backgrounds_add_done_cb     (HDBackgrounds  *backgrounds,
                                                GSourceFunc     done_callback,
                                                gpointer        cb_data,
                                                GDestroyNotify  destroy_data);
 
+/* View argument of hd_backgrounds_add_create_cached_image () for commands
+ * which create the cached images of all views */
+#define HD_BACKGROUNDS_ALL_VIEWS G_MAXUINT
+
+GCancellable  *hd_backgrounds_job_cancellable_new     (GCancellable       *cancellable);
+
 void           hd_backgrounds_add_create_cached_image (HDBackgrounds      *backgrounds,
                                                        GFile              *source_file,
+                                                       guint               view,
                                                        gboolean            error_dialogs,
+                                                       gboolean            update_gconf,
                                                        GCancellable       *cancellable,
                                                        HDCommandCallback   command,
                                                        gpointer            data,
@@ -92,6 +103,47 @@ gboolean       hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                                  GError        **error);
 void hd_backgrounds_report_corrupt_image        (const GError   *error);
 
+HDBackgroundsSource *hd_backgrounds_source_ref   (HDBackgrounds       *backgrounds,
+                                                  GFile               *file);
+void                 hd_backgrounds_source_unref (HDBackgroundsSource *source);
+GdkPixbuf           *hd_backgrounds_source_load_scaled_and_cropped (HDBackgroundsSource  *source,
+                                                                    HDImageSize          *size,
+                                                                    char                **etag,
+                                                                    GCancellable         *cancellable,
+                                                                    GError              **error);
+gboolean             hd_backgrounds_source_is_decoded (HDBackgroundsSource  *source,
+                                                       HDImageSize          *size);
+gboolean             hd_backgrounds_source_save_cached_image (HDBackgroundsSource  *source,
+                                                              GdkPixbuf            *pixbuf,
+                                                              guint                 view,
+                                                              const char           *source_etag,
+                                                              gboolean              error_dialogs,
+                                                              gboolean              update_gconf,
+                                                              GCancellable         *cancellable,
+                                                              GError              **error);
+gboolean             hd_backgrounds_source_link_rendered_image (HDBackgroundsSource  *source,
+                                                                HDImageSize          *size,
+                                                                guint                 view,
+                                                                gboolean              update_gconf,
+                                                                GCancellable         *cancellable);
+
+gboolean             hd_backgrounds_source_publish_preview (HDBackgroundsSource  *source,
+                                                            HDImageSize          *size,
+                                                            guint                 view,
+                                                            GCancellable         *cancellable);
+void                 hd_backgrounds_source_finish_preview  (HDBackgroundsSource  *source,
+                                                            guint                 view,
+                                                            GCancellable         *cancellable);
+GdkPixbuf           *hd_backgrounds_source_get_prerendered (HDBackgroundsSource  *source,
+                                                            guint                 view,
+                                                            HDImageSize          *size,
+                                                            char                **etag);
+
+void                 hd_backgrounds_prerender (HDBackgrounds *backgrounds,
+                                               GFile         *file,
+                                               guint          view,
+                                               GCancellable  *cancellable);
+
 gboolean hd_backgrounds_is_portrait_wallpaper_enabled (HDBackgrounds *backgrounds);
 
 G_END_DECLS
@@ -75,6 +75,7 @@ struct _HDBookmarkShortcutPrivate
   gboolean button_pressed;
 
   gchar *url;
+  gchar *icon_path;
 
   GConfClient *gconf_client;
 
@@ -152,86 +153,79 @@ get_url_from_gconf (GConfClient *client,
                                 "url");
 }
 
-static inline cairo_surface_t *
-scale_icon (cairo_surface_t *icon,
-            double           width,
-            double           height)
+typedef struct
 {
-  cairo_surface_t *scaled_icon;
-  cairo_t *cr;
-
-  scaled_icon = cairo_surface_create_similar (icon,
-                                              cairo_surface_get_content (icon),
-                                              THUMBNAIL_WIDTH,
-                                              THUMBNAIL_HEIGHT);
-
-  cr = cairo_create (scaled_icon);
-
-  cairo_scale (cr,
-               THUMBNAIL_WIDTH / width,
-               THUMBNAIL_HEIGHT / height);
-
-  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-  cairo_set_source_surface (cr,
-                            icon,
-                            0.0,
-                            0.0);
-
-  cairo_paint (cr);
-  cairo_destroy (cr);
+  HDBookmarkShortcut *shortcut;
+  gchar              *icon_path;
+} ThumbnailRequest;
 
-  return scaled_icon;
-}
-
-static inline cairo_surface_t *
-scale_icon_if_required (cairo_surface_t *icon)
+static void
+thumbnail_loaded (HDCairoSurfaceCache *cache,
+                  cairo_surface_t     *surface,
+                  gpointer             data)
 {
-  cairo_surface_t *scaled_icon;
-  int width, height;
+  ThumbnailRequest *request = data;
+  HDBookmarkShortcutPrivate *priv = request->shortcut->priv;
 
-  width = cairo_image_surface_get_width (icon);
-  height = cairo_image_surface_get_height (icon);
+  /* The icon changed in the meantime or the shortcut was disposed */
+  if (g_strcmp0 (request->icon_path, priv->icon_path))
+    goto cleanup;
 
-  if (width == THUMBNAIL_WIDTH &&
-      height == THUMBNAIL_HEIGHT)
-    return cairo_surface_reference (icon);
+  if (!surface)
+    {
+      g_warning ("%s. Could not get thumbnail from file %s.",
+                 __FUNCTION__,
+                 request->icon_path);
+      goto cleanup;
+    }
+
+  if (priv->thumbnail_icon)
+    cairo_surface_destroy (priv->thumbnail_icon);
+  priv->thumbnail_icon = cairo_surface_reference (surface);
 
-  scaled_icon = scale_icon (icon, width, height);
+  gtk_widget_queue_draw (GTK_WIDGET (request->shortcut));
 
-  return scaled_icon;
+cleanup:
+  g_object_unref (request->shortcut);
+  g_free (request->icon_path);
+  g_slice_free (ThumbnailRequest, request);
 }
 
-static inline cairo_surface_t *
-get_icon_from_gconf (GConfClient *client,
-                     const gchar *plugin_id)
+/*
+ * The thumbnail scaled to the thumbnail size is shared with other shortcuts
+ * using the same file. It is created in a worker thread if not cached yet.
+ */
+static void
+hd_bookmark_shortcut_update_thumbnail (HDBookmarkShortcut *shortcut)
 {
-  gchar *icon_path;
-
-  icon_path = get_icon_path_from_gconf (client, plugin_id);
-
-  if (icon_path)
-    {
-      cairo_surface_t *icon, *scaled_icon = NULL;
-      cairo_status_t status;
-
-      icon = cairo_image_surface_create_from_png (icon_path);
-      status = cairo_surface_status (icon);
-
-      if (status != CAIRO_STATUS_SUCCESS)
-        g_warning ("%s. Could not get thumbnail from file %s. %s",
-                   __FUNCTION__,
-                   icon_path,
-                   cairo_status_to_string (status));
-      else
-        scaled_icon = scale_icon_if_required (icon);
+  HDBookmarkShortcutPrivate *priv = shortcut->priv;
+  ThumbnailRequest *request;
 
-      cairo_surface_destroy (icon);
-      g_free (icon_path);
+  if (priv->thumbnail_icon)
+    priv->thumbnail_icon = (cairo_surface_destroy (priv->thumbnail_icon), NULL);
 
-      return scaled_icon;
-    }
+  if (!priv->icon_path)
+    return;
 
-  return NULL;
+  priv->thumbnail_icon = hd_cairo_surface_cache_lookup_scaled_surface (hd_cairo_surface_cache_get (),
+                                                                       priv->icon_path,
+                                                                       THUMBNAIL_WIDTH,
+                                                                       THUMBNAIL_HEIGHT,
+                                                                       CAIRO_CONTENT_COLOR_ALPHA);
+  if (priv->thumbnail_icon)
+    return;
+
+  request = g_slice_new (ThumbnailRequest);
+  request->shortcut = g_object_ref (shortcut);
+  request->icon_path = g_strdup (priv->icon_path);
+
+  hd_cairo_surface_cache_get_scaled_surface_async (hd_cairo_surface_cache_get (),
+                                                   priv->icon_path,
+                                                   THUMBNAIL_WIDTH,
+                                                   THUMBNAIL_HEIGHT,
+                                                   CAIRO_CONTENT_COLOR_ALPHA,
+                                                   thumbnail_loaded,
+                                                   request);
 }
 
 static void
@@ -249,11 +243,10 @@ hd_bookmark_shortcut_update_from_gconf (HDBookmarkShortcut *shortcut)
                       label);
   g_free (label);
 
-  if (priv->thumbnail_icon)
-    priv->thumbnail_icon = (cairo_surface_destroy (priv->thumbnail_icon), NULL);
-
-  priv->thumbnail_icon = get_icon_from_gconf (priv->gconf_client,
+  g_free (priv->icon_path);
+  priv->icon_path = get_icon_path_from_gconf (priv->gconf_client,
                                               plugin_id);
+  hd_bookmark_shortcut_update_thumbnail (shortcut);
 
   /* Get URL from GConf */
   g_free (priv->url);
@@ -295,6 +288,9 @@ hd_bookmark_shortcut_dispose (GObject *object)
   if (priv->default_thumbnail_icon)
     priv->default_thumbnail_icon = (cairo_surface_destroy (priv->default_thumbnail_icon), NULL);
 
+  /* Pending thumbnail loads are ignored after this */
+  priv->icon_path = (g_free (priv->icon_path), NULL);
+
   /* Chain up */
   G_OBJECT_CLASS (hd_bookmark_shortcut_parent_class)->dispose (object);
 }
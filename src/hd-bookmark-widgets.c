@@ -38,6 +38,8 @@
 #include <osso_bookmark_parser.h>
 
 #include "hd-bookmark-widgets.h"
+#include "hd-cairo-surface-cache.h"
+#include "hd-pixbuf-utils.h"
 
 #define HD_BOOKMARK_WIDGETS_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_BOOKMARK_WIDGETS, HDBookmarkWidgetsPrivate))
@@ -46,6 +48,10 @@
 
 #define BOOKMARK_EXTENSION_LEN 3
 
+/* Size of the bookmark thumbnails in the selector */
+#define THUMBNAIL_WIDTH 106
+#define THUMBNAIL_HEIGHT 64
+
 /* GConf path for boomarks */
 #define BOOKMARKS_GCONF_PATH      "/apps/osso/hildon-home/bookmarks"
 #define BOOKMARKS_GCONF_KEY_LABEL BOOKMARKS_GCONF_PATH "/%s/label"
@@ -67,6 +73,60 @@ struct _HDBookmarkWidgetsPrivate
 
 G_DEFINE_TYPE (HDBookmarkWidgets, hd_bookmark_widgets, HD_TYPE_WIDGETS);
 
+static void
+thumbnail_loaded (HDCairoSurfaceCache *cache,
+                  cairo_surface_t     *surface,
+                  gpointer             data)
+{
+  GtkTreeRowReference *row = data;
+
+  if (surface && gtk_tree_row_reference_valid (row))
+    {
+      GtkTreeModel *model = gtk_tree_row_reference_get_model (row);
+      GtkTreePath *path = gtk_tree_row_reference_get_path (row);
+      GtkTreeIter iter;
+
+      if (gtk_tree_model_get_iter (model, &iter, path))
+        {
+          GdkPixbuf *pixbuf = hd_pixbuf_utils_new_from_surface (surface);
+
+          gtk_list_store_set (GTK_LIST_STORE (model),
+                              &iter,
+                              3, pixbuf,
+                              -1);
+          g_object_unref (pixbuf);
+        }
+
+      gtk_tree_path_free (path);
+    }
+
+  gtk_tree_row_reference_free (row);
+}
+
+/* Fits the thumbnail into THUMBNAIL_WIDTH x THUMBNAIL_HEIGHT keeping its
+ * aspect ratio, like gdk_pixbuf_new_from_file_at_size() does. Only the
+ * image header is read. */
+static void
+get_thumbnail_size (const gchar *filename,
+                    gint        *width,
+                    gint        *height)
+{
+  gint image_width, image_height;
+
+  *width = THUMBNAIL_WIDTH;
+  *height = THUMBNAIL_HEIGHT;
+
+  if (!gdk_pixbuf_get_file_info (filename, &image_width, &image_height) ||
+      image_width <= 0 || image_height <= 0)
+    return;
+
+  if ((gint64) image_height * THUMBNAIL_WIDTH >
+      (gint64) image_width * THUMBNAIL_HEIGHT)
+    *width = MAX (1, (image_width * THUMBNAIL_HEIGHT + image_height / 2) / image_height);
+  else
+    *height = MAX (1, (image_height * THUMBNAIL_WIDTH + image_width / 2) / image_width);
+}
+
 static void
 hd_bookmark_widgets_add_bookmark_item (HDBookmarkWidgets *widgets,
                                        BookmarkItem      *item)
@@ -75,6 +135,9 @@ hd_bookmark_widgets_add_bookmark_item (HDBookmarkWidgets *widgets,
   GdkPixbuf *pixbuf = NULL;
   gchar *name;
   gchar *icon_path = NULL;
+  gboolean load_thumbnail = FALSE;
+  gint thumbnail_width = 0, thumbnail_height = 0;
+  GtkTreeIter iter;
 
   /* If it is a folder recurse over all children */
   if (item->isFolder)
@@ -102,12 +165,30 @@ hd_bookmark_widgets_add_bookmark_item (HDBookmarkWidgets *widgets,
 
   if (item->thumbnail_file)
     {
+      cairo_surface_t *surface;
+
       icon_path = g_build_filename (g_get_home_dir (),
                                     THUMBNAIL_PATH,
                                     item->thumbnail_file,
                                     NULL);
 
-      pixbuf = gdk_pixbuf_new_from_file_at_size (icon_path, 106, 64, NULL);
+      get_thumbnail_size (icon_path,
+                          &thumbnail_width,
+                          &thumbnail_height);
+
+      /* Scaled thumbnails are shared, load them in a worker otherwise */
+      surface = hd_cairo_surface_cache_lookup_scaled_surface (hd_cairo_surface_cache_get (),
+                                                              icon_path,
+                                                              thumbnail_width,
+                                                              thumbnail_height,
+                                                              CAIRO_CONTENT_COLOR_ALPHA);
+      if (surface)
+        {
+          pixbuf = hd_pixbuf_utils_new_from_surface (surface);
+          cairo_surface_destroy (surface);
+        }
+      else
+        load_thumbnail = TRUE;
     }
 
   if (!pixbuf)
@@ -120,13 +201,28 @@ hd_bookmark_widgets_add_bookmark_item (HDBookmarkWidgets *widgets,
     }
 
   gtk_list_store_insert_with_values (GTK_LIST_STORE (priv->model),
-                                     NULL, -1,
+                                     &iter, -1,
                                      0, name,
                                      1, icon_path,
                                      2, item->url,
                                      3, pixbuf,
                                      -1);
 
+  if (load_thumbnail)
+    {
+      GtkTreePath *path = gtk_tree_model_get_path (priv->model, &iter);
+
+      hd_cairo_surface_cache_get_scaled_surface_async (hd_cairo_surface_cache_get (),
+                                                       icon_path,
+                                                       thumbnail_width,
+                                                       thumbnail_height,
+                                                       CAIRO_CONTENT_COLOR_ALPHA,
+                                                       thumbnail_loaded,
+                                                       gtk_tree_row_reference_new (priv->model,
+                                                                                   path));
+      gtk_tree_path_free (path);
+    }
+
   g_free (name);
   g_free (icon_path);
   if (pixbuf)
@@ -26,18 +26,641 @@
 
 #include "hd-cairo-surface-cache.h"
 
+#include <gdk/gdk.h>
 #include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hd-command-thread-pool.h"
 
 #define HD_CAIRO_SURFACE_CACHE_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_CAIRO_SURFACE_CACHE, HDCairoSurfaceCachePrivate))
 
+/* Default budget for unreferenced surfaces in bytes */
+#define DEFAULT_MAX_SIZE (2 * 1024 * 1024)
+
+/* Cached surfaces are checked against their file at most this often, in
+ * microseconds, so hits do not stat the file on every lookup */
+#define REVALIDATE_INTERVAL (10 * G_USEC_PER_SEC)
+
+#define IMAGES_DIR "/etc/hildon/theme/images/"
+
+/* Theme images used by the home widgets and notification windows */
+static const gchar *theme_images[] = {
+  IMAGES_DIR "ApplicationShortcutApplet.png",
+  IMAGES_DIR "ApplicationShortcutAppletPressed.png",
+  IMAGES_DIR "WebShortcutAppletBackground.png",
+  IMAGES_DIR "WebShortcutAppletBackgroundActive.png",
+  IMAGES_DIR "WebShortCutAppletThumbnailMask.png",
+  IMAGES_DIR "wmIncomingEvent.png",
+  NULL
+};
+
+/* Decoded theme images are stored in this directory below the user cache
+ * dir, so they can be mapped on the next start instead of decoded again */
+#define DISK_CACHE_DIR "hildon-home-surfaces"
+
+#define DISK_CACHE_MAGIC 0x48445343 /* HDSC */
+#define DISK_CACHE_VERSION 1
+
+/* Header of a disk cache file, followed by the premultiplied ARGB32 or
+ * RGB24 pixel data */
+typedef struct
+{
+  guint32 magic;
+  guint32 version;
+  gint64  mtime;
+  gint64  file_size;
+  gint32  width;
+  gint32  height;
+  gint32  stride;
+  gint32  format;
+} DiskCacheHeader;
+
+typedef struct
+{
+  gpointer data;
+  gsize    length;
+} DiskCacheMapping;
+
+static const cairo_user_data_key_t disk_cache_mapping_key;
+
+typedef struct
+{
+  gchar           *key;
+  cairo_surface_t *surface;
+  gsize            size;
+  GList           *lru_link;
+
+  /* The file the surface was created from, used to detect changes */
+  gchar           *filename;
+  time_t           mtime;
+  goffset          file_size;
+  gint64           validated_time;
+} CacheEntry;
+
+typedef struct
+{
+  HDCairoSurfaceCacheCallback callback;
+  gpointer                    data;
+} LoadCallback;
+
+typedef struct
+{
+  HDCairoSurfaceCache *cache;
+  gchar               *key;
+  gchar               *filename;
+
+  /* Size and content of the scaled variant, 0x0 for the original image */
+  gint                 width;
+  gint                 height;
+  cairo_content_t      content;
+
+  /* The original image, decoded in the worker unless already cached */
+  cairo_surface_t     *source;
+  gboolean             decoded;
+
+  cairo_surface_t     *surface;
+  time_t               mtime;
+  goffset              file_size;
+  GSList              *callbacks;
+} SurfaceLoad;
+
 struct _HDCairoSurfaceCachePrivate
 {
+  /* key -> CacheEntry */
   GHashTable *table;
+
+  /* CacheEntries, most recently used first */
+  GQueue     *lru;
+
+  gsize       size;
+  gsize       max_size;
+
+  guint       hits;
+  guint       misses;
+  guint       evictions;
+
+  /* filename -> SurfaceLoad for running asynchronous loads */
+  GHashTable *pending;
+
+  HDCommandThreadPool *thread_pool;
 };
 
 G_DEFINE_TYPE (HDCairoSurfaceCache, hd_cairo_surface_cache, G_TYPE_OBJECT);
 
+static gsize
+get_surface_size (cairo_surface_t *surface)
+{
+  if (cairo_surface_get_type (surface) == CAIRO_SURFACE_TYPE_IMAGE)
+    return cairo_image_surface_get_stride (surface) *
+           cairo_image_surface_get_height (surface);
+
+  return 0;
+}
+
+static gboolean
+get_file_stat (const gchar *filename,
+               time_t      *mtime,
+               goffset     *file_size)
+{
+  struct stat buf;
+
+  if (g_stat (filename, &buf) != 0)
+    return FALSE;
+
+  *mtime = buf.st_mtime;
+  *file_size = buf.st_size;
+
+  return TRUE;
+}
+
+static gchar *
+get_disk_cache_filename (const gchar *filename)
+{
+  gchar *checksum, *basename, *path;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, filename, -1);
+  basename = g_strconcat (checksum, ".surface", NULL);
+
+  path = g_build_filename (g_get_user_cache_dir (),
+                           DISK_CACHE_DIR,
+                           basename,
+                           NULL);
+
+  g_free (basename);
+  g_free (checksum);
+
+  return path;
+}
+
+static void
+disk_cache_mapping_free (DiskCacheMapping *mapping)
+{
+  munmap (mapping->data, mapping->length);
+  g_slice_free (DiskCacheMapping, mapping);
+}
+
+/*
+ * Maps the decoded image of @filename from the disk cache if it is up
+ * to date. Can be called from any thread.
+ */
+static cairo_surface_t *
+disk_cache_load (const gchar *filename,
+                 time_t       mtime,
+                 goffset      file_size)
+{
+  gchar *path;
+  int fd;
+  struct stat buf;
+  gpointer data = MAP_FAILED;
+  const DiskCacheHeader *header;
+  DiskCacheMapping *mapping;
+  cairo_surface_t *surface = NULL;
+
+  path = get_disk_cache_filename (filename);
+  fd = g_open (path, O_RDONLY, 0);
+  g_free (path);
+
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &buf) != 0 ||
+      buf.st_size < (off_t) sizeof (DiskCacheHeader))
+    goto cleanup;
+
+  /* Private writable mapping, cairo expects writable data */
+  data = mmap (NULL, buf.st_size,
+               PROT_READ | PROT_WRITE,
+               MAP_PRIVATE,
+               fd, 0);
+  if (data == MAP_FAILED)
+    goto cleanup;
+
+  header = data;
+
+  if (header->magic != DISK_CACHE_MAGIC ||
+      header->version != DISK_CACHE_VERSION ||
+      header->mtime != mtime ||
+      header->file_size != file_size ||
+      header->width <= 0 ||
+      header->height <= 0 ||
+      (header->format != CAIRO_FORMAT_ARGB32 &&
+       header->format != CAIRO_FORMAT_RGB24) ||
+      header->stride != cairo_format_stride_for_width (header->format,
+                                                       header->width) ||
+      buf.st_size < (off_t) (sizeof (DiskCacheHeader) +
+                             (gsize) header->stride * header->height))
+    goto cleanup;
+
+  surface = cairo_image_surface_create_for_data ((guchar *) data + sizeof (DiskCacheHeader),
+                                                 header->format,
+                                                 header->width,
+                                                 header->height,
+                                                 header->stride);
+
+  /* Unmap together with the surface */
+  mapping = g_slice_new (DiskCacheMapping);
+  mapping->data = data;
+  mapping->length = buf.st_size;
+  cairo_surface_set_user_data (surface,
+                               &disk_cache_mapping_key,
+                               mapping,
+                               (cairo_destroy_func_t) disk_cache_mapping_free);
+  data = MAP_FAILED;
+
+cleanup:
+  if (data != MAP_FAILED)
+    munmap (data, buf.st_size);
+  close (fd);
+
+  return surface;
+}
+
+static gboolean
+write_all (int            fd,
+           gconstpointer  data,
+           gsize          length)
+{
+  const guchar *p = data;
+
+  while (length > 0)
+    {
+      gssize written = write (fd, p, length);
+
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+
+      p += written;
+      length -= written;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Stores the decoded image of @filename in the disk cache. Can be called
+ * from any thread.
+ */
+static void
+disk_cache_store (const gchar     *filename,
+                  cairo_surface_t *surface,
+                  time_t           mtime,
+                  goffset          file_size)
+{
+  DiskCacheHeader header = { 0, };
+  gchar *dir, *path, *tmp_path;
+  int fd;
+  gboolean success;
+
+  header.format = cairo_image_surface_get_format (surface);
+  if (header.format != CAIRO_FORMAT_ARGB32 &&
+      header.format != CAIRO_FORMAT_RGB24)
+    return;
+
+  dir = g_build_filename (g_get_user_cache_dir (),
+                          DISK_CACHE_DIR,
+                          NULL);
+  g_mkdir_with_parents (dir, 0755);
+  g_free (dir);
+
+  path = get_disk_cache_filename (filename);
+  tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+
+  fd = g_mkstemp (tmp_path);
+  if (fd < 0)
+    {
+      g_debug ("%s. Could not create %s. %s",
+               __FUNCTION__,
+               tmp_path,
+               g_strerror (errno));
+      goto cleanup;
+    }
+
+  cairo_surface_flush (surface);
+
+  header.magic = DISK_CACHE_MAGIC;
+  header.version = DISK_CACHE_VERSION;
+  header.mtime = mtime;
+  header.file_size = file_size;
+  header.width = cairo_image_surface_get_width (surface);
+  header.height = cairo_image_surface_get_height (surface);
+  header.stride = cairo_image_surface_get_stride (surface);
+
+  success = write_all (fd, &header, sizeof (DiskCacheHeader)) &&
+            write_all (fd,
+                       cairo_image_surface_get_data (surface),
+                       (gsize) header.stride * header.height);
+  close (fd);
+
+  /* Replace atomically, other processes might map the old file */
+  if (!success || g_rename (tmp_path, path) != 0)
+    {
+      g_debug ("%s. Could not write %s. %s",
+               __FUNCTION__,
+               path,
+               g_strerror (errno));
+      g_unlink (tmp_path);
+    }
+
+cleanup:
+  g_free (tmp_path);
+  g_free (path);
+}
+
+/*
+ * Decodes @filename. Can be called from any thread.
+ *
+ * Returns: the image surface or %NULL if @filename could not be loaded
+ */
+static cairo_surface_t *
+load_png_file (const gchar *filename,
+               time_t      *mtime,
+               goffset     *file_size)
+{
+  cairo_surface_t *surface;
+
+  if (!get_file_stat (filename, mtime, file_size))
+    {
+      g_debug ("%s. Could not stat %s", __FUNCTION__, filename);
+      return NULL;
+    }
+
+  /* Only theme images are stored on disk, they are used on every start */
+  if (g_str_has_prefix (filename, IMAGES_DIR))
+    {
+      surface = disk_cache_load (filename, *mtime, *file_size);
+      if (surface)
+        return surface;
+    }
+
+  surface = cairo_image_surface_create_from_png (filename);
+
+  if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS)
+    {
+      g_debug ("%s. Could not load %s. %s",
+               __FUNCTION__,
+               filename,
+               cairo_status_to_string (cairo_surface_status (surface)));
+      cairo_surface_destroy (surface);
+      return NULL;
+    }
+
+  if (g_str_has_prefix (filename, IMAGES_DIR))
+    disk_cache_store (filename, surface, *mtime, *file_size);
+
+  return surface;
+}
+
+/*
+ * Scales @source to @width x @height. Can be called from any thread.
+ *
+ * Returns: a new reference to the scaled surface, which is @source itself
+ * if it already has the requested size and content
+ */
+static cairo_surface_t *
+scale_surface (cairo_surface_t *source,
+               gint             width,
+               gint             height,
+               cairo_content_t  content)
+{
+  cairo_surface_t *surface;
+  gint source_width, source_height;
+  cairo_t *cr;
+
+  source_width = cairo_image_surface_get_width (source);
+  source_height = cairo_image_surface_get_height (source);
+
+  if (source_width == width &&
+      source_height == height &&
+      cairo_surface_get_content (source) == content)
+    return cairo_surface_reference (source);
+
+  surface = cairo_image_surface_create (content == CAIRO_CONTENT_COLOR ?
+                                        CAIRO_FORMAT_RGB24 :
+                                        CAIRO_FORMAT_ARGB32,
+                                        width,
+                                        height);
+
+  cr = cairo_create (surface);
+
+  cairo_scale (cr,
+               ((double) width) / source_width,
+               ((double) height) / source_height);
+
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface (cr,
+                            source,
+                            0.0,
+                            0.0);
+
+  cairo_paint (cr);
+  cairo_destroy (cr);
+
+  return surface;
+}
+
+static inline gchar *
+get_scaled_key (const gchar     *filename,
+                gint             width,
+                gint             height,
+                cairo_content_t  content)
+{
+  return g_strdup_printf ("%s@%dx%d/%x", filename, width, height, content);
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_free (entry->key);
+  g_free (entry->filename);
+  cairo_surface_destroy (entry->surface);
+
+  g_slice_free (CacheEntry, entry);
+}
+
+/*
+ * Surfaces still referenced outside of the cache (e.g. by widgets) are
+ * pinned and never evicted.
+ */
+static inline gboolean
+cache_entry_is_pinned (CacheEntry *entry)
+{
+  return cairo_surface_get_reference_count (entry->surface) > 1;
+}
+
+static void
+cache_remove_entry (HDCairoSurfaceCache *cache,
+                    CacheEntry          *entry)
+{
+  HDCairoSurfaceCachePrivate *priv = cache->priv;
+
+  priv->size -= entry->size;
+  g_queue_delete_link (priv->lru, entry->lru_link);
+
+  /* Frees the entry */
+  g_hash_table_remove (priv->table, entry->key);
+}
+
+/*
+ * Evict least recently used unpinned surfaces until the cache fits into
+ * its budget.
+ */
+static void
+cache_evict (HDCairoSurfaceCache *cache)
+{
+  HDCairoSurfaceCachePrivate *priv = cache->priv;
+  GList *l;
+
+  l = priv->lru->tail;
+  while (l && priv->size > priv->max_size)
+    {
+      CacheEntry *entry = l->data;
+
+      l = l->prev;
+
+      if (cache_entry_is_pinned (entry))
+        continue;
+
+      g_debug ("%s. Evict %s (%" G_GSIZE_FORMAT " bytes)",
+               __FUNCTION__,
+               entry->key,
+               entry->size);
+
+      cache_remove_entry (cache, entry);
+      priv->evictions++;
+    }
+}
+
+/*
+ * Returns the cached surface for @key (not referenced) and marks it as
+ * most recently used.
+ */
+static cairo_surface_t *
+cache_lookup (HDCairoSurfaceCache *cache,
+              const gchar         *key)
+{
+  HDCairoSurfaceCachePrivate *priv = cache->priv;
+  CacheEntry *entry;
+
+  entry = g_hash_table_lookup (priv->table,
+                               key);
+
+  /* Drop entries whose file changed on disk, e.g. on theme update */
+  if (entry && entry->filename &&
+      g_get_monotonic_time () - entry->validated_time > REVALIDATE_INTERVAL)
+    {
+      time_t mtime;
+      goffset file_size;
+
+      entry->validated_time = g_get_monotonic_time ();
+
+      if (!get_file_stat (entry->filename, &mtime, &file_size) ||
+          mtime != entry->mtime ||
+          file_size != entry->file_size)
+        {
+          g_debug ("%s. %s changed on disk", __FUNCTION__, entry->filename);
+          cache_remove_entry (cache, entry);
+          entry = NULL;
+        }
+    }
+
+  if (!entry)
+    {
+      priv->misses++;
+      return NULL;
+    }
+
+  priv->hits++;
+
+  g_queue_unlink (priv->lru, entry->lru_link);
+  g_queue_push_head_link (priv->lru, entry->lru_link);
+
+  return entry->surface;
+}
+
+/*
+ * Adds @surface created from @filename to the cache, takes ownership of
+ * @key and @surface.
+ */
+static void
+cache_insert (HDCairoSurfaceCache *cache,
+              gchar               *key,
+              cairo_surface_t     *surface,
+              const gchar         *filename,
+              time_t               mtime,
+              goffset              file_size)
+{
+  HDCairoSurfaceCachePrivate *priv = cache->priv;
+  CacheEntry *entry;
+
+  entry = g_hash_table_lookup (priv->table,
+                               key);
+  if (entry)
+    cache_remove_entry (cache, entry);
+
+  entry = g_slice_new0 (CacheEntry);
+  entry->key = key;
+  entry->surface = surface;
+  entry->size = get_surface_size (surface);
+  entry->filename = g_strdup (filename);
+  entry->mtime = mtime;
+  entry->file_size = file_size;
+  entry->validated_time = g_get_monotonic_time ();
+
+  g_queue_push_head (priv->lru, entry);
+  entry->lru_link = priv->lru->head;
+  priv->size += entry->size;
+
+  g_hash_table_insert (priv->table,
+                       entry->key,
+                       entry);
+
+  cache_evict (cache);
+}
+
+/*
+ * Returns the cached scaled variant of @filename (not referenced).
+ */
+static cairo_surface_t *
+cache_lookup_scaled (HDCairoSurfaceCache *cache,
+                     const gchar         *filename,
+                     gint                 width,
+                     gint                 height,
+                     cairo_content_t      content)
+{
+  cairo_surface_t *surface;
+  gchar *key;
+
+  key = get_scaled_key (filename, width, height, content);
+  surface = cache_lookup (cache, key);
+  g_free (key);
+
+  if (!surface)
+    {
+      /* Unscaled variants are only cached as the original */
+      surface = cache_lookup (cache, filename);
+
+      if (surface &&
+          (cairo_image_surface_get_width (surface) != width ||
+           cairo_image_surface_get_height (surface) != height ||
+           cairo_surface_get_content (surface) != content))
+        surface = NULL;
+    }
+
+  return surface;
+}
+
 static void
 hd_cairo_surface_cache_dispose (GObject *object)
 {
@@ -46,6 +669,15 @@ hd_cairo_surface_cache_dispose (GObject *object)
   if (priv->table)
     priv->table = (g_hash_table_destroy (priv->table), NULL);
 
+  if (priv->lru)
+    priv->lru = (g_queue_free (priv->lru), NULL);
+
+  if (priv->thread_pool)
+    priv->thread_pool = (g_object_unref (priv->thread_pool), NULL);
+
+  if (priv->pending)
+    priv->pending = (g_hash_table_destroy (priv->pending), NULL);
+
   G_OBJECT_CLASS (hd_cairo_surface_cache_parent_class)->dispose (object);
 }
 
@@ -67,8 +699,15 @@ hd_cairo_surface_cache_init (HDCairoSurfaceCache *cache)
   cache->priv = priv;
 
   priv->table = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                       g_free,
-                                       (GDestroyNotify) cairo_surface_destroy);
+                                       NULL,
+                                       (GDestroyNotify) cache_entry_free);
+  priv->lru = g_queue_new ();
+  priv->pending = g_hash_table_new (g_str_hash, g_str_equal);
+
+  priv->thread_pool = hd_command_thread_pool_new ();
+  hd_command_thread_pool_set_name (priv->thread_pool, "surface-cache");
+
+  priv->max_size = DEFAULT_MAX_SIZE;
 }
 
 HDCairoSurfaceCache *
@@ -86,38 +725,491 @@ hd_cairo_surface_cache_get (void)
 cairo_surface_t *
 hd_cairo_surface_cache_get_surface (HDCairoSurfaceCache *cache,
                                     const gchar         *filename)
+{
+  cairo_surface_t *surface;
+
+  surface = cache_lookup (cache,
+                          filename);
+
+  if (!surface)
+    {
+      time_t mtime;
+      goffset file_size;
+
+      surface = load_png_file (filename, &mtime, &file_size);
+
+      /* Do not cache failures, callers get an error surface */
+      if (!surface)
+        return cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 0, 0);
+
+      cache_insert (cache,
+                    g_strdup (filename),
+                    cairo_surface_reference (surface),
+                    filename,
+                    mtime,
+                    file_size);
+
+      /* Drop the cache reference, the returned one pins the surface */
+      cairo_surface_destroy (surface);
+    }
+
+  return cairo_surface_reference (surface);
+}
+
+static void
+surface_load_free (SurfaceLoad *load)
+{
+  g_slist_foreach (load->callbacks, (GFunc) g_free, NULL);
+  g_slist_free (load->callbacks);
+
+  if (load->source)
+    cairo_surface_destroy (load->source);
+
+  if (load->surface)
+    cairo_surface_destroy (load->surface);
+
+  g_free (load->key);
+  g_free (load->filename);
+  g_object_unref (load->cache);
+
+  g_slice_free (SurfaceLoad, load);
+}
+
+static gboolean
+surface_load_finished (SurfaceLoad *load)
+{
+  HDCairoSurfaceCache *cache = load->cache;
+  HDCairoSurfaceCachePrivate *priv = cache->priv;
+  cairo_surface_t *surface = NULL;
+  GSList *l;
+
+  g_hash_table_remove (priv->pending, load->key);
+
+  /* Keep the decoded original around for other variants, a synchronous
+   * load might have been faster though */
+  if (load->decoded && load->source &&
+      !cache_lookup (cache, load->filename))
+    cache_insert (cache,
+                  g_strdup (load->filename),
+                  cairo_surface_reference (load->source),
+                  load->filename,
+                  load->mtime,
+                  load->file_size);
+
+  if (load->surface == load->source)
+    {
+      /* Unscaled variants are only cached as the original */
+      surface = load->surface;
+    }
+  else if (load->surface)
+    {
+      surface = cache_lookup (cache, load->key);
+
+      if (!surface)
+        {
+          surface = load->surface;
+          cache_insert (cache,
+                        g_strdup (load->key),
+                        cairo_surface_reference (surface),
+                        load->filename,
+                        load->mtime,
+                        load->file_size);
+        }
+    }
+
+  /* Keep the surface alive during the callbacks */
+  if (surface)
+    cairo_surface_reference (surface);
+
+  load->callbacks = g_slist_reverse (load->callbacks);
+  for (l = load->callbacks; l; l = l->next)
+    {
+      LoadCallback *cb = l->data;
+
+      cb->callback (cache, surface, cb->data);
+    }
+
+  if (surface)
+    cairo_surface_destroy (surface);
+
+  return FALSE;
+}
+
+/* Runs in the thread pool */
+static void
+surface_load_execute (SurfaceLoad *load)
+{
+  if (!load->source)
+    {
+      load->source = load_png_file (load->filename,
+                                    &load->mtime,
+                                    &load->file_size);
+      load->decoded = TRUE;
+    }
+
+  if (load->source)
+    {
+      if (load->width > 0 && load->height > 0)
+        load->surface = scale_surface (load->source,
+                                       load->width,
+                                       load->height,
+                                       load->content);
+      else
+        load->surface = cairo_surface_reference (load->source);
+    }
+
+  gdk_threads_add_idle_full (G_PRIORITY_DEFAULT_IDLE,
+                             (GSourceFunc) surface_load_finished,
+                             load,
+                             (GDestroyNotify) surface_load_free);
+}
+
+static gboolean
+surface_cached_idle (SurfaceLoad *load)
+{
+  LoadCallback *cb = load->callbacks->data;
+
+  cb->callback (load->cache, load->surface, cb->data);
+
+  return FALSE;
+}
+
+static void
+surface_load_start (HDCairoSurfaceCache         *cache,
+                    const gchar                 *filename,
+                    gint                         width,
+                    gint                         height,
+                    cairo_content_t              content,
+                    HDCairoSurfaceCacheCallback  callback,
+                    gpointer                     data)
 {
   HDCairoSurfaceCachePrivate *priv = cache->priv;
   cairo_surface_t *surface;
+  SurfaceLoad *load;
+  LoadCallback *cb = NULL;
+  gchar *key;
+
+  if (width > 0 && height > 0)
+    key = get_scaled_key (filename, width, height, content);
+  else
+    key = g_strdup (filename);
+
+  if (callback)
+    {
+      cb = g_new (LoadCallback, 1);
+      cb->callback = callback;
+      cb->data = data;
+    }
+
+  /* Join a running load */
+  load = g_hash_table_lookup (priv->pending, key);
+  if (load)
+    {
+      if (cb)
+        load->callbacks = g_slist_prepend (load->callbacks, cb);
+      g_free (key);
+      return;
+    }
+
+  load = g_slice_new0 (SurfaceLoad);
+  load->cache = g_object_ref (cache);
+  load->key = key;
+  load->filename = g_strdup (filename);
+  load->width = width;
+  load->height = height;
+  load->content = content;
+  if (cb)
+    load->callbacks = g_slist_prepend (NULL, cb);
+
+  if (width > 0 && height > 0)
+    surface = cache_lookup_scaled (cache, filename, width, height, content);
+  else
+    surface = cache_lookup (cache, filename);
+
+  if (surface)
+    {
+      /* Already cached, just deliver it from the main loop */
+      if (cb)
+        {
+          load->surface = cairo_surface_reference (surface);
+          gdk_threads_add_idle_full (G_PRIORITY_DEFAULT_IDLE,
+                                     (GSourceFunc) surface_cached_idle,
+                                     load,
+                                     (GDestroyNotify) surface_load_free);
+        }
+      else
+        surface_load_free (load);
+
+      return;
+    }
+
+  /* Only scale in the worker if the original is cached already */
+  if (load->width > 0 && load->height > 0)
+    {
+      surface = cache_lookup (cache, filename);
+      if (surface)
+        {
+          CacheEntry *entry = g_hash_table_lookup (priv->table, filename);
+
+          load->source = cairo_surface_reference (surface);
+          load->mtime = entry->mtime;
+          load->file_size = entry->file_size;
+        }
+    }
+
+  g_hash_table_insert (priv->pending,
+                       load->key,
+                       load);
+
+  hd_command_thread_pool_push (priv->thread_pool,
+                               (HDCommandCallback) surface_load_execute,
+                               load,
+                               NULL);
+}
+
+/**
+ * hd_cairo_surface_cache_get_surface_async:
+ * @cache: a #HDCairoSurfaceCache
+ * @filename: the PNG file to load
+ * @callback: called in the main loop when the surface is available or %NULL
+ * @data: user data for @callback
+ *
+ * Decodes @filename in a worker thread if it is not cached yet. The
+ * surface passed to @callback is owned by the cache, take a reference to
+ * keep it. It is %NULL if the file could not be loaded.
+ */
+void
+hd_cairo_surface_cache_get_surface_async (HDCairoSurfaceCache         *cache,
+                                          const gchar                 *filename,
+                                          HDCairoSurfaceCacheCallback  callback,
+                                          gpointer                     data)
+{
+  g_return_if_fail (HD_IS_CAIRO_SURFACE_CACHE (cache));
+  g_return_if_fail (filename);
+
+  surface_load_start (cache,
+                      filename,
+                      0, 0,
+                      CAIRO_CONTENT_COLOR_ALPHA,
+                      callback,
+                      data);
+}
+
+/**
+ * hd_cairo_surface_cache_get_scaled_surface:
+ * @cache: a #HDCairoSurfaceCache
+ * @filename: the PNG file to load
+ * @width: width of the scaled variant
+ * @height: height of the scaled variant
+ * @content: content of the scaled variant
+ *
+ * Returns the image from @filename scaled to @width x @height. The scaled
+ * variant is created once and shared by all callers.
+ *
+ * Returns: a new reference to the scaled surface or %NULL if @filename
+ * could not be loaded
+ */
+cairo_surface_t *
+hd_cairo_surface_cache_get_scaled_surface (HDCairoSurfaceCache *cache,
+                                           const gchar         *filename,
+                                           gint                 width,
+                                           gint                 height,
+                                           cairo_content_t      content)
+{
+  cairo_surface_t *surface;
+  gchar *key;
+
+  g_return_val_if_fail (HD_IS_CAIRO_SURFACE_CACHE (cache), NULL);
+  g_return_val_if_fail (filename, NULL);
 
-  surface = g_hash_table_lookup (priv->table,
-                                 filename);
+  surface = cache_lookup_scaled (cache,
+                                 filename,
+                                 width,
+                                 height,
+                                 content);
 
   if (!surface)
     {
       cairo_surface_t *image_surface;
-      cairo_t *cr;
-
-      image_surface = cairo_image_surface_create_from_png (filename);
-      surface = cairo_surface_create_similar (image_surface,
-                                              cairo_surface_get_content (image_surface),
-                                              cairo_image_surface_get_width (image_surface),
-                                              cairo_image_surface_get_height (image_surface));
-      cr = cairo_create (surface);
-      cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-      cairo_set_source_surface (cr,
-                                image_surface,
-                                0,
-                                0);
-
-      cairo_paint (cr);
-      cairo_destroy (cr);
-      cairo_surface_destroy (image_surface);
+      CacheEntry *source;
+
+      image_surface = hd_cairo_surface_cache_get_surface (cache,
+                                                          filename);
+
+      if (cairo_surface_status (image_surface) != CAIRO_STATUS_SUCCESS)
+        {
+          cairo_surface_destroy (image_surface);
+          return NULL;
+        }
 
-      g_hash_table_insert (priv->table,
-                           g_strdup (filename),
-                           surface);
+      surface = scale_surface (image_surface,
+                               width,
+                               height,
+                               content);
+
+      /* The original has the requested size, it is cached already */
+      if (surface == image_surface)
+        {
+          cairo_surface_destroy (image_surface);
+          return surface;
+        }
+
+      source = g_hash_table_lookup (cache->priv->table, filename);
+      cache_insert (cache,
+                    get_scaled_key (filename, width, height, content),
+                    cairo_surface_reference (surface),
+                    filename,
+                    source ? source->mtime : 0,
+                    source ? source->file_size : 0);
+
+      cairo_surface_destroy (image_surface);
+      cairo_surface_destroy (surface);
     }
 
   return cairo_surface_reference (surface);
 }
+
+/**
+ * hd_cairo_surface_cache_lookup_scaled_surface:
+ * @cache: a #HDCairoSurfaceCache
+ * @filename: the PNG file
+ * @width: width of the scaled variant
+ * @height: height of the scaled variant
+ * @content: content of the scaled variant
+ *
+ * Like hd_cairo_surface_cache_get_scaled_surface() but never loads the
+ * image.
+ *
+ * Returns: a new reference to the scaled surface or %NULL if it is not
+ * cached
+ */
+cairo_surface_t *
+hd_cairo_surface_cache_lookup_scaled_surface (HDCairoSurfaceCache *cache,
+                                              const gchar         *filename,
+                                              gint                 width,
+                                              gint                 height,
+                                              cairo_content_t      content)
+{
+  cairo_surface_t *surface;
+
+  g_return_val_if_fail (HD_IS_CAIRO_SURFACE_CACHE (cache), NULL);
+  g_return_val_if_fail (filename, NULL);
+
+  surface = cache_lookup_scaled (cache,
+                                 filename,
+                                 width,
+                                 height,
+                                 content);
+
+  return surface ? cairo_surface_reference (surface) : NULL;
+}
+
+/**
+ * hd_cairo_surface_cache_get_scaled_surface_async:
+ * @cache: a #HDCairoSurfaceCache
+ * @filename: the PNG file to load
+ * @width: width of the scaled variant
+ * @height: height of the scaled variant
+ * @content: content of the scaled variant
+ * @callback: called in the main loop when the surface is available or %NULL
+ * @data: user data for @callback
+ *
+ * Asynchronous version of hd_cairo_surface_cache_get_scaled_surface().
+ * Decoding and scaling are done in a worker thread. The surface passed to
+ * @callback is owned by the cache.
+ */
+void
+hd_cairo_surface_cache_get_scaled_surface_async (HDCairoSurfaceCache         *cache,
+                                                 const gchar                 *filename,
+                                                 gint                         width,
+                                                 gint                         height,
+                                                 cairo_content_t              content,
+                                                 HDCairoSurfaceCacheCallback  callback,
+                                                 gpointer                     data)
+{
+  g_return_if_fail (HD_IS_CAIRO_SURFACE_CACHE (cache));
+  g_return_if_fail (filename);
+  g_return_if_fail (width > 0 && height > 0);
+
+  surface_load_start (cache,
+                      filename,
+                      width,
+                      height,
+                      content,
+                      callback,
+                      data);
+}
+
+/**
+ * hd_cairo_surface_cache_preload:
+ * @cache: a #HDCairoSurfaceCache
+ *
+ * Decodes the known theme images in a worker thread, so they are already
+ * cached when the widgets are realized.
+ */
+void
+hd_cairo_surface_cache_preload (HDCairoSurfaceCache *cache)
+{
+  guint i;
+
+  g_return_if_fail (HD_IS_CAIRO_SURFACE_CACHE (cache));
+
+  for (i = 0; theme_images[i]; i++)
+    hd_cairo_surface_cache_get_surface_async (cache,
+                                              theme_images[i],
+                                              NULL,
+                                              NULL);
+}
+
+/**
+ * hd_cairo_surface_cache_set_max_size:
+ * @cache: a #HDCairoSurfaceCache
+ * @max_size: the budget in bytes
+ *
+ * Sets the amount of image memory the cache may hold. Least recently used
+ * surfaces are evicted when the budget is exceeded, surfaces which are
+ * still referenced outside of the cache are never evicted.
+ */
+void
+hd_cairo_surface_cache_set_max_size (HDCairoSurfaceCache *cache,
+                                     gsize                max_size)
+{
+  g_return_if_fail (HD_IS_CAIRO_SURFACE_CACHE (cache));
+
+  cache->priv->max_size = max_size;
+
+  cache_evict (cache);
+}
+
+/**
+ * hd_cairo_surface_cache_get_stats:
+ * @cache: a #HDCairoSurfaceCache
+ * @hits: return location for the number of cache hits or %NULL
+ * @misses: return location for the number of cache misses or %NULL
+ * @evictions: return location for the number of evicted surfaces or %NULL
+ * @size: return location for the current cache size in bytes or %NULL
+ *
+ * Returns the cache counters.
+ */
+void
+hd_cairo_surface_cache_get_stats (HDCairoSurfaceCache *cache,
+                                  guint               *hits,
+                                  guint               *misses,
+                                  guint               *evictions,
+                                  gsize               *size)
+{
+  HDCairoSurfaceCachePrivate *priv;
+
+  g_return_if_fail (HD_IS_CAIRO_SURFACE_CACHE (cache));
+
+  priv = cache->priv;
+
+  if (hits)
+    *hits = priv->hits;
+  if (misses)
+    *misses = priv->misses;
+  if (evictions)
+    *evictions = priv->evictions;
+  if (size)
+    *size = priv->size;
+}
@@ -55,11 +55,51 @@ struct _HDCairoSurfaceCacheClass
   GObjectClass parent;
 };
 
+/**
+ * HDCairoSurfaceCacheCallback:
+ * @cache: the #HDCairoSurfaceCache
+ * @surface: the loaded surface owned by the cache or %NULL on error
+ * @data: user data
+ */
+typedef void (*HDCairoSurfaceCacheCallback) (HDCairoSurfaceCache *cache,
+                                             cairo_surface_t     *surface,
+                                             gpointer             data);
+
 GType                hd_cairo_surface_cache_get_type    (void);
 
 HDCairoSurfaceCache *hd_cairo_surface_cache_get         (void);
 cairo_surface_t *    hd_cairo_surface_cache_get_surface (HDCairoSurfaceCache *cache,
                                                          const gchar         *filename);
+void                 hd_cairo_surface_cache_get_surface_async (HDCairoSurfaceCache         *cache,
+                                                               const gchar                 *filename,
+                                                               HDCairoSurfaceCacheCallback  callback,
+                                                               gpointer                     data);
+void                 hd_cairo_surface_cache_preload     (HDCairoSurfaceCache *cache);
+cairo_surface_t *    hd_cairo_surface_cache_get_scaled_surface (HDCairoSurfaceCache *cache,
+                                                                const gchar         *filename,
+                                                                gint                 width,
+                                                                gint                 height,
+                                                                cairo_content_t      content);
+cairo_surface_t *    hd_cairo_surface_cache_lookup_scaled_surface (HDCairoSurfaceCache *cache,
+                                                                   const gchar         *filename,
+                                                                   gint                 width,
+                                                                   gint                 height,
+                                                                   cairo_content_t      content);
+void                 hd_cairo_surface_cache_get_scaled_surface_async (HDCairoSurfaceCache         *cache,
+                                                                      const gchar                 *filename,
+                                                                      gint                         width,
+                                                                      gint                         height,
+                                                                      cairo_content_t              content,
+                                                                      HDCairoSurfaceCacheCallback  callback,
+                                                                      gpointer                     data);
+
+void                 hd_cairo_surface_cache_set_max_size (HDCairoSurfaceCache *cache,
+                                                          gsize                max_size);
+void                 hd_cairo_surface_cache_get_stats    (HDCairoSurfaceCache *cache,
+                                                          guint               *hits,
+                                                          guint               *misses,
+                                                          guint               *evictions,
+                                                          gsize               *size);
 
 G_END_DECLS
 
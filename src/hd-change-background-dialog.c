@@ -37,6 +37,8 @@
 #include "hd-change-background-dialog.h"
 #include "hd-dbus-utils.h"
 #include "hd-desktop.h"
+#include "hd-file-background.h"
+#include "hd-imageset-background.h"
 
 /* Add Image dialog */
 #define RESPONSE_ADD 1
@@ -67,6 +69,9 @@ struct _HDChangeBackgroundDialogPrivate
   guint scroll_to_selected_id;
 
   GCancellable *cancellable;
+
+  /* Speculative render of the selected background */
+  GCancellable *prerender_cancellable;
 };
 
 G_DEFINE_TYPE (HDChangeBackgroundDialog, hd_change_background_dialog, GTK_TYPE_DIALOG);
@@ -108,6 +113,73 @@ backgrounds_selection_changed (HDAvailableBackgrounds   *backgrounds,
                                                       dialog);
 }
 
+/* The view the selected background is applied to */
+static guint
+get_target_view (HDChangeBackgroundDialog *dialog)
+{
+  HDChangeBackgroundDialogPrivate *priv = dialog->priv;
+
+  if (hd_change_background_dialog_is_portrait ()
+        && hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
+    return priv->current_view + HD_DESKTOP_VIEWS;
+
+  return priv->current_view;
+}
+
+/* Renders the selected background while the user is still browsing, so
+ * applying it is fast */
+static void
+prerender_selected (HDChangeBackgroundDialog *dialog,
+                    GtkTreeModel             *model,
+                    GtkTreeIter              *iter)
+{
+  HDChangeBackgroundDialogPrivate *priv = dialog->priv;
+  HDBackground *background = NULL;
+  GFile *image_file, *current_file;
+  guint view;
+
+  /* The selection moved, the previous image is not needed anymore */
+  if (priv->prerender_cancellable)
+    {
+      g_cancellable_cancel (priv->prerender_cancellable);
+      priv->prerender_cancellable = (g_object_unref (priv->prerender_cancellable), NULL);
+    }
+
+  gtk_tree_model_get (model, iter,
+                      HD_BACKGROUND_COL_OBJECT, &background,
+                      -1);
+  if (!background)
+    return;
+
+  /* Wallpaper strips and themes are not rendered from a single image */
+  if (!HD_IS_FILE_BACKGROUND (background) &&
+      !HD_IS_IMAGESET_BACKGROUND (background))
+    {
+      g_object_unref (background);
+      return;
+    }
+
+  view = get_target_view (dialog);
+
+  image_file = hd_background_get_image_file_for_view (background,
+                                                      view);
+  current_file = hd_backgrounds_get_background (hd_backgrounds_get (),
+                                                view);
+
+  if (image_file &&
+      !(current_file && g_file_equal (image_file, current_file)))
+    {
+      priv->prerender_cancellable = g_cancellable_new ();
+
+      hd_backgrounds_prerender (hd_backgrounds_get (),
+                                image_file,
+                                view,
+                                priv->prerender_cancellable);
+    }
+
+  g_object_unref (background);
+}
+
 static void
 _hd_background_selector_changed (HildonTouchSelector* widget,
                                  gint column,
@@ -132,6 +204,8 @@ _hd_background_selector_changed (HildonTouchSelector* widget,
     {
       hd_utils_open_link (HD_OVI_LINK_BACKGROUNDS);
     }
+  else
+    prerender_selected (dialog, model, &iter);
 }
 
 static void
@@ -169,6 +243,12 @@ hd_change_background_dialog_dispose (GObject *object)
   if (priv->cancellable)
     priv->cancellable = (g_object_unref (priv->cancellable), NULL);
 
+  if (priv->prerender_cancellable)
+    {
+      g_cancellable_cancel (priv->prerender_cancellable);
+      priv->prerender_cancellable = (g_object_unref (priv->prerender_cancellable), NULL);
+    }
+
   G_OBJECT_CLASS (hd_change_background_dialog_parent_class)->dispose (object);
 }
 
@@ -340,15 +420,9 @@ hd_change_background_dialog_response (GtkDialog *dialog,
                                                     TRUE);
           gtk_widget_set_sensitive (GTK_WIDGET (dialog), FALSE);
 
-          if (hd_change_background_dialog_is_portrait () 
-                && hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
-            hd_background_set_for_current_view (background,
-                                                priv->current_view + HD_DESKTOP_VIEWS,
-                                                priv->cancellable);
-          else
-            hd_background_set_for_current_view (background,
-                                                priv->current_view,
-                                                priv->cancellable);
+          hd_background_set_for_current_view (background,
+                                              get_target_view (HD_CHANGE_BACKGROUND_DIALOG (dialog)),
+                                              priv->cancellable);
 
             hd_backgrounds_add_done_cb (hd_backgrounds_get (),
                                         background_set_cb,
@@ -30,15 +30,44 @@
 #define HD_COMMAND_THREAD_POOL_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_COMMAND_THREAD_POOL, HDCommandThreadPoolPrivate))
 
+/* Commands running longer are warned about, longer waits are only
+ * logged as debug messages, in microseconds */
+#define SLOW_COMMAND_THRESHOLD (2 * G_USEC_PER_SEC)
+
+#define DEFAULT_COMMAND_NAME "command"
+
+typedef struct
+{
+  guint  count;
+  guint  cancelled;
+  guint  failed;
+  gint64 wait_time;
+  gint64 max_wait_time;
+  gint64 run_time;
+  gint64 max_run_time;
+} CommandStats;
+
 typedef struct
 {
+  HDCommandThreadPool *pool;
+
+  guint id;
+  guint64 sequence;
+  HDCommandPriority priority;
+  GList *link;
+
+  const gchar *name;
+  gint64 push_time;
+  gboolean cancelled;
+  gboolean failed;
+
   HDCommandCallback command;
   gpointer data;
   GDestroyNotify destroy_data;
 } ThreadCommand;
 
-static void           thread_command_execute (ThreadCommand *thread_command,
-                                              gpointer       data);
+static void           thread_command_execute (gpointer             token,
+                                              HDCommandThreadPool *pool);
 static ThreadCommand *thread_command_new     (HDCommandCallback command,
                                               gpointer          data,
                                               GDestroyNotify    destroy_data);
@@ -50,6 +79,10 @@ typedef struct
   GSourceFunc function;
   gpointer data;
   GDestroyNotify destroy_data;
+
+  /* Number of commands pushed before which are not finished yet */
+  guint64 sequence;
+  guint pending;
 } IdleCommandData;
 
 static IdleCommandData *idle_command_data_new  (gint           priority,
@@ -61,11 +94,65 @@ static void             idle_command_data_free (IdleCommandData *command_data);
 
 struct _HDCommandThreadPoolPrivate
 {
+  /* Only used to run the workers, it gets one token per queued command */
   GThreadPool *thread_pool;
+
+  GMutex mutex;
+
+  /* Queued commands, one queue per HDCommandPriority */
+  GQueue queues[HD_COMMAND_PRIORITY_SPECULATIVE + 1];
+
+  /* id -> queued ThreadCommand */
+  GHashTable *queued;
+
+  guint next_id;
+  guint64 next_sequence;
+
+  /* Number of queued or running commands */
+  guint outstanding;
+
+  /* Pending IdleCommandData, in push order */
+  GQueue barriers;
+
+  gchar *name;
+  guint max_threads;
+
+  /* command name -> CommandStats, phases are stored as name:phase */
+  GHashTable *stats;
 };
 
 G_DEFINE_TYPE (HDCommandThreadPool, hd_command_thread_pool, G_TYPE_OBJECT);
 
+/* The ThreadCommand executed in the current thread */
+static GPrivate current_command = G_PRIVATE_INIT (NULL);
+
+/* All pools, for hd_command_thread_pool_get_statistics () */
+G_LOCK_DEFINE_STATIC (pools);
+static GSList *pools = NULL;
+
+/* Called with the mutex locked */
+static CommandStats *
+get_stats (HDCommandThreadPoolPrivate *priv,
+           const gchar                *name)
+{
+  CommandStats *stats;
+
+  stats = g_hash_table_lookup (priv->stats, name);
+  if (!stats)
+    {
+      stats = g_slice_new0 (CommandStats);
+      g_hash_table_insert (priv->stats, g_strdup (name), stats);
+    }
+
+  return stats;
+}
+
+static void
+command_stats_free (CommandStats *stats)
+{
+  g_slice_free (CommandStats, stats);
+}
+
 static void
 hd_command_thread_pool_dipose (GObject *object)
 {
@@ -73,21 +160,53 @@ hd_command_thread_pool_dipose (GObject *object)
 
   if (priv->thread_pool)
     {
+      /* Waits until all queued commands are executed */
       g_thread_pool_free (priv->thread_pool,
                           FALSE,
                           TRUE);
       priv->thread_pool = NULL;
     }
 
+  if (priv->queued)
+    priv->queued = (g_hash_table_destroy (priv->queued), NULL);
+
+  /* Barriers which were never added as idle sources */
+  while (priv->barriers.head)
+    {
+      IdleCommandData *command_data = g_queue_pop_head (&priv->barriers);
+
+      if (command_data->destroy_data)
+        command_data->destroy_data (command_data->data);
+      idle_command_data_free (command_data);
+    }
+
   G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->dispose (object);
 }
 
+static void
+hd_command_thread_pool_finalize (GObject *object)
+{
+  HDCommandThreadPoolPrivate *priv = HD_COMMAND_THREAD_POOL (object)->priv;
+
+  G_LOCK (pools);
+  pools = g_slist_remove (pools, object);
+  G_UNLOCK (pools);
+
+  g_hash_table_destroy (priv->stats);
+  g_free (priv->name);
+
+  g_mutex_clear (&priv->mutex);
+
+  G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->finalize (object);
+}
+
 static void
 hd_command_thread_pool_class_init (HDCommandThreadPoolClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->dispose = hd_command_thread_pool_dipose;
+  object_class->finalize = hd_command_thread_pool_finalize;
 
   g_type_class_add_private (klass, sizeof (HDCommandThreadPoolPrivate));
 }
@@ -96,22 +215,158 @@ static void
 hd_command_thread_pool_init (HDCommandThreadPool *command_thread_pool)
 {
   HDCommandThreadPoolPrivate *priv;
+  guint i;
 
   priv = HD_COMMAND_THREAD_POOL_GET_PRIVATE (command_thread_pool);
   command_thread_pool->priv = priv;
 
+  g_mutex_init (&priv->mutex);
+
+  for (i = 0; i < G_N_ELEMENTS (priv->queues); i++)
+    g_queue_init (&priv->queues[i]);
+  g_queue_init (&priv->barriers);
+
+  priv->queued = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->next_id = 1;
+
+  priv->stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free,
+                                       (GDestroyNotify) command_stats_free);
+  priv->max_threads = 1;
+
+  G_LOCK (pools);
+  pools = g_slist_append (pools, command_thread_pool);
+  G_UNLOCK (pools);
+
   priv->thread_pool = g_thread_pool_new ((GFunc) thread_command_execute,
-                                         NULL,
+                                         command_thread_pool,
                                          1,
                                          FALSE,
                                          NULL);
 }
 
+/* Called with the mutex locked */
+static ThreadCommand *
+pop_command (HDCommandThreadPoolPrivate *priv)
+{
+  ThreadCommand *thread_command = NULL;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (priv->queues) && !thread_command; i++)
+    thread_command = g_queue_pop_head (&priv->queues[i]);
+
+  if (thread_command)
+    {
+      thread_command->link = NULL;
+      g_hash_table_remove (priv->queued,
+                           GUINT_TO_POINTER (thread_command->id));
+    }
+
+  return thread_command;
+}
+
+/* Called with the mutex locked */
+static void
+update_stats (HDCommandThreadPoolPrivate *priv,
+              ThreadCommand              *thread_command,
+              gint64                      wait_time,
+              gint64                      run_time)
+{
+  CommandStats *stats = get_stats (priv, thread_command->name);
+
+  stats->count++;
+  if (thread_command->cancelled)
+    stats->cancelled++;
+  if (thread_command->failed)
+    stats->failed++;
+
+  stats->wait_time += wait_time;
+  stats->max_wait_time = MAX (stats->max_wait_time, wait_time);
+  stats->run_time += run_time;
+  stats->max_run_time = MAX (stats->max_run_time, run_time);
+
+  /* Long waits are normal when many commands are queued, e.g. on theme
+   * changes, only long running commands are unexpected */
+  if (run_time > SLOW_COMMAND_THRESHOLD)
+    g_warning ("%s. Slow %s in %s: waited %" G_GINT64_FORMAT " ms, "
+               "ran %" G_GINT64_FORMAT " ms, %u queued",
+               __FUNCTION__,
+               thread_command->name,
+               priv->name ? priv->name : "unnamed",
+               wait_time / 1000,
+               run_time / 1000,
+               g_hash_table_size (priv->queued));
+  else if (wait_time > SLOW_COMMAND_THRESHOLD)
+    g_debug ("%s. %s in %s waited %" G_GINT64_FORMAT " ms, %u queued",
+             __FUNCTION__,
+             thread_command->name,
+             priv->name ? priv->name : "unnamed",
+             wait_time / 1000,
+             g_hash_table_size (priv->queued));
+}
+
+/*
+ * Called with the mutex locked when the command with @sequence is
+ * finished. Runs the barriers which do not wait for other commands anymore.
+ */
 static void
-thread_command_execute (ThreadCommand *thread_command,
-                        gpointer       data)
+finish_command (HDCommandThreadPoolPrivate *priv,
+                guint64                     sequence)
 {
+  GList *l;
+
+  priv->outstanding--;
+
+  for (l = priv->barriers.head; l; l = l->next)
+    {
+      IdleCommandData *command_data = l->data;
+
+      if (command_data->sequence > sequence)
+        command_data->pending--;
+    }
+
+  while (priv->barriers.head &&
+         ((IdleCommandData *) priv->barriers.head->data)->pending == 0)
+    {
+      IdleCommandData *command_data = g_queue_pop_head (&priv->barriers);
+
+      idle_command_execute (command_data);
+      idle_command_data_free (command_data);
+    }
+}
+
+static void
+thread_command_execute (gpointer             token,
+                        HDCommandThreadPool *pool)
+{
+  HDCommandThreadPoolPrivate *priv = pool->priv;
+  ThreadCommand *thread_command;
+  gint64 start_time, end_time;
+
+  /* Each token stands for one command, run the most important one */
+  g_mutex_lock (&priv->mutex);
+  thread_command = pop_command (priv);
+  g_mutex_unlock (&priv->mutex);
+
+  if (!thread_command)
+    return;
+
+  start_time = g_get_monotonic_time ();
+
+  g_private_set (&current_command, thread_command);
   thread_command->command (thread_command->data);
+  g_private_set (&current_command, NULL);
+
+  end_time = g_get_monotonic_time ();
+
+  g_mutex_lock (&priv->mutex);
+  update_stats (priv,
+                thread_command,
+                start_time - thread_command->push_time,
+                end_time - start_time);
+  finish_command (priv, thread_command->sequence);
+  g_mutex_unlock (&priv->mutex);
+
   thread_command_free (thread_command);
 }
 
@@ -120,7 +375,7 @@ thread_command_new (HDCommandCallback command,
                     gpointer          data,
                     GDestroyNotify    destroy_data)
 {
-  ThreadCommand *thread_command = g_slice_new (ThreadCommand);
+  ThreadCommand *thread_command = g_slice_new0 (ThreadCommand);
 
   thread_command->command = command;
   thread_command->data = data;
@@ -147,24 +402,135 @@ hd_command_thread_pool_new (void)
   return g_object_new (HD_TYPE_COMMAND_THREAD_POOL, NULL);
 }
 
+/**
+ * hd_command_thread_pool_new_full:
+ * @max_threads: the number of worker threads
+ *
+ * Creates a pool which executes up to @max_threads commands in parallel.
+ * Commands are started in priority order, commands with the same priority
+ * in push order.
+ *
+ * Returns: a new #HDCommandThreadPool
+ */
+HDCommandThreadPool *
+hd_command_thread_pool_new_full (guint max_threads)
+{
+  HDCommandThreadPool *pool;
+
+  pool = g_object_new (HD_TYPE_COMMAND_THREAD_POOL, NULL);
+
+  hd_command_thread_pool_set_max_threads (pool, max_threads);
+
+  return pool;
+}
+
+/**
+ * hd_command_thread_pool_set_max_threads:
+ * @pool: a #HDCommandThreadPool
+ * @max_threads: the number of worker threads
+ *
+ * Changes the number of commands executed in parallel. Queued commands
+ * are started on the new workers right away.
+ */
+void
+hd_command_thread_pool_set_max_threads (HDCommandThreadPool *pool,
+                                        guint                max_threads)
+{
+  HDCommandThreadPoolPrivate *priv;
+  GError *error = NULL;
+
+  g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
+
+  priv = pool->priv;
+
+  g_mutex_lock (&priv->mutex);
+  priv->max_threads = MAX (max_threads, 1);
+  g_mutex_unlock (&priv->mutex);
+
+  g_thread_pool_set_max_threads (priv->thread_pool,
+                                 MAX (max_threads, 1),
+                                 &error);
+
+  if (error)
+    {
+      g_debug ("%s. Error: %s", __FUNCTION__, error->message);
+      g_error_free (error);
+    }
+}
+
 void
 hd_command_thread_pool_push (HDCommandThreadPool *pool,
                              HDCommandCallback    command,
                              gpointer             data,
                              GDestroyNotify       destroy_data)
+{
+  hd_command_thread_pool_push_full (pool,
+                                    HD_COMMAND_PRIORITY_DEFAULT,
+                                    NULL,
+                                    command,
+                                    data,
+                                    destroy_data);
+}
+
+/**
+ * hd_command_thread_pool_push_full:
+ * @pool: a #HDCommandThreadPool
+ * @priority: the lane of the command
+ * @name: the type of the command for the statistics or %NULL, must be a
+ *   static string
+ * @command: the command to execute in a worker thread
+ * @data: data for @command
+ * @destroy_data: called with @data after @command was executed
+ *
+ * Queues @command with @priority.
+ *
+ * Returns: an id for hd_command_thread_pool_set_priority()
+ */
+guint
+hd_command_thread_pool_push_full (HDCommandThreadPool *pool,
+                                  HDCommandPriority    priority,
+                                  const gchar         *name,
+                                  HDCommandCallback    command,
+                                  gpointer             data,
+                                  GDestroyNotify       destroy_data)
 {
   HDCommandThreadPoolPrivate *priv;
+  ThreadCommand *thread_command;
   GError *error = NULL;
+  guint id;
 
-  g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
+  g_return_val_if_fail (HD_IS_COMMAND_THREAD_POOL (pool), 0);
+  g_return_val_if_fail (priority <= HD_COMMAND_PRIORITY_SPECULATIVE, 0);
 
   priv = pool->priv;
 
-  ThreadCommand *thread_command = thread_command_new (command,
-                                                      data,
-                                                      destroy_data);
+  thread_command = thread_command_new (command,
+                                       data,
+                                       destroy_data);
+  thread_command->pool = pool;
+  thread_command->priority = priority;
+  thread_command->name = name ? name : DEFAULT_COMMAND_NAME;
+  thread_command->push_time = g_get_monotonic_time ();
+
+  g_mutex_lock (&priv->mutex);
+
+  id = thread_command->id = priv->next_id++;
+  if (G_UNLIKELY (!priv->next_id))
+    priv->next_id = 1;
+  thread_command->sequence = priv->next_sequence++;
+
+  g_queue_push_tail (&priv->queues[priority], thread_command);
+  thread_command->link = priv->queues[priority].tail;
+  g_hash_table_insert (priv->queued,
+                       GUINT_TO_POINTER (id),
+                       thread_command);
+
+  priv->outstanding++;
+
+  g_mutex_unlock (&priv->mutex);
+
   g_thread_pool_push (priv->thread_pool,
-                      thread_command,
+                      GUINT_TO_POINTER (id),
                       &error);
 
   if (error)
@@ -172,8 +538,129 @@ hd_command_thread_pool_push (HDCommandThreadPool *pool,
       g_debug ("%s. Error: %s", __FUNCTION__, error->message);
       g_error_free (error);
     }
+
+  return id;
+}
+
+/**
+ * hd_command_thread_pool_set_priority:
+ * @pool: a #HDCommandThreadPool
+ * @id: the id returned by hd_command_thread_pool_push_full()
+ * @priority: the new priority
+ *
+ * Moves a queued command into another lane, e.g. when the view it
+ * renders became the current one.
+ *
+ * Returns: %TRUE if the command was still queued
+ */
+gboolean
+hd_command_thread_pool_set_priority (HDCommandThreadPool *pool,
+                                     guint                id,
+                                     HDCommandPriority    priority)
+{
+  HDCommandThreadPoolPrivate *priv;
+  ThreadCommand *thread_command;
+  GQueue *queue;
+  GList *l;
+
+  g_return_val_if_fail (HD_IS_COMMAND_THREAD_POOL (pool), FALSE);
+  g_return_val_if_fail (priority <= HD_COMMAND_PRIORITY_SPECULATIVE, FALSE);
+
+  priv = pool->priv;
+
+  g_mutex_lock (&priv->mutex);
+
+  thread_command = g_hash_table_lookup (priv->queued,
+                                        GUINT_TO_POINTER (id));
+
+  if (thread_command && thread_command->priority != priority)
+    {
+      g_queue_delete_link (&priv->queues[thread_command->priority],
+                           thread_command->link);
+
+      /* Keep push order inside the lane */
+      queue = &priv->queues[priority];
+      for (l = queue->tail; l; l = l->prev)
+        if (((ThreadCommand *) l->data)->sequence < thread_command->sequence)
+          break;
+
+      if (l)
+        {
+          g_queue_insert_after (queue, l, thread_command);
+          thread_command->link = l->next;
+        }
+      else
+        {
+          g_queue_push_head (queue, thread_command);
+          thread_command->link = queue->head;
+        }
+
+      thread_command->priority = priority;
+    }
+
+  g_mutex_unlock (&priv->mutex);
+
+  return thread_command != NULL;
 }
 
+/**
+ * hd_command_thread_pool_remove:
+ * @pool: a #HDCommandThreadPool
+ * @id: the id returned by hd_command_thread_pool_push_full()
+ *
+ * Drops a queued command without executing it. The destroy notify of the
+ * command data is still called.
+ *
+ * Returns: %TRUE if the command was still queued
+ */
+gboolean
+hd_command_thread_pool_remove (HDCommandThreadPool *pool,
+                               guint                id)
+{
+  HDCommandThreadPoolPrivate *priv;
+  ThreadCommand *thread_command;
+
+  g_return_val_if_fail (HD_IS_COMMAND_THREAD_POOL (pool), FALSE);
+
+  priv = pool->priv;
+
+  g_mutex_lock (&priv->mutex);
+
+  thread_command = g_hash_table_lookup (priv->queued,
+                                        GUINT_TO_POINTER (id));
+
+  /* The token of the command stays in the thread pool, the worker which
+   * gets the last token will not find a command anymore */
+  if (thread_command)
+    {
+      g_queue_delete_link (&priv->queues[thread_command->priority],
+                           thread_command->link);
+      g_hash_table_remove (priv->queued,
+                           GUINT_TO_POINTER (id));
+
+      get_stats (priv, thread_command->name)->cancelled++;
+
+      finish_command (priv, thread_command->sequence);
+    }
+
+  g_mutex_unlock (&priv->mutex);
+
+  thread_command_free (thread_command);
+
+  return thread_command != NULL;
+}
+
+/**
+ * hd_command_thread_pool_push_idle:
+ * @pool: a #HDCommandThreadPool
+ * @priority: the priority of the idle source
+ * @function: the idle function
+ * @data: data for @function
+ * @destroy_data: called with @data when the idle source is removed
+ *
+ * Adds @function as idle source as soon as all commands pushed before
+ * are finished, regardless of their priority.
+ */
 void
 hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                   gint                 priority,
@@ -181,19 +668,33 @@ hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                   gpointer             data,
                                   GDestroyNotify       destroy_data)
 {
+  HDCommandThreadPoolPrivate *priv;
   IdleCommandData *command_data;
 
   g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
 
+  priv = pool->priv;
+
   command_data = idle_command_data_new (priority,
                                         function,
                                         data,
                                         destroy_data);
 
-  hd_command_thread_pool_push (pool,
-                               (HDCommandCallback) idle_command_execute,
-                               command_data,
-                               (GDestroyNotify) idle_command_data_free);
+  g_mutex_lock (&priv->mutex);
+
+  command_data->sequence = priv->next_sequence++;
+  command_data->pending = priv->outstanding;
+
+  /* Earlier barriers are never run after this one */
+  if (command_data->pending == 0 && !priv->barriers.head)
+    {
+      idle_command_execute (command_data);
+      idle_command_data_free (command_data);
+    }
+  else
+    g_queue_push_tail (&priv->barriers, command_data);
+
+  g_mutex_unlock (&priv->mutex);
 }
 
 static IdleCommandData *
@@ -202,7 +703,7 @@ idle_command_data_new (gint           priority,
                        gpointer       data,
                        GDestroyNotify destroy_data)
 {
-  IdleCommandData *command_data = g_slice_new (IdleCommandData);
+  IdleCommandData *command_data = g_slice_new0 (IdleCommandData);
 
   command_data->priority = priority;
   command_data->function = function;
@@ -230,3 +731,146 @@ idle_command_data_free (IdleCommandData *command_data)
   g_slice_free (IdleCommandData, command_data);
 }
 
+/**
+ * hd_command_thread_pool_set_name:
+ * @pool: a #HDCommandThreadPool
+ * @name: the name of the pool in the statistics
+ */
+void
+hd_command_thread_pool_set_name (HDCommandThreadPool *pool,
+                                 const gchar         *name)
+{
+  g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
+
+  g_mutex_lock (&pool->priv->mutex);
+  g_free (pool->priv->name);
+  pool->priv->name = g_strdup (name);
+  g_mutex_unlock (&pool->priv->mutex);
+}
+
+/**
+ * hd_command_thread_pool_command_cancelled:
+ *
+ * Called by a command which stopped because it was cancelled. Does
+ * nothing outside of a command.
+ */
+void
+hd_command_thread_pool_command_cancelled (void)
+{
+  ThreadCommand *thread_command = g_private_get (&current_command);
+
+  if (thread_command)
+    thread_command->cancelled = TRUE;
+}
+
+/**
+ * hd_command_thread_pool_command_failed:
+ *
+ * Called by a command which failed. Does nothing outside of a command.
+ */
+void
+hd_command_thread_pool_command_failed (void)
+{
+  ThreadCommand *thread_command = g_private_get (&current_command);
+
+  if (thread_command)
+    thread_command->failed = TRUE;
+}
+
+/**
+ * hd_command_thread_pool_record_phase:
+ * @phase: name of the phase, e.g. "decode"
+ * @start_time: monotonic time when the phase started
+ *
+ * Adds the time since @start_time to the statistics of @phase of the
+ * current command. Does nothing outside of a command.
+ */
+void
+hd_command_thread_pool_record_phase (const gchar *phase,
+                                     gint64       start_time)
+{
+  ThreadCommand *thread_command = g_private_get (&current_command);
+  HDCommandThreadPoolPrivate *priv;
+  CommandStats *stats;
+  gchar *name;
+  gint64 run_time;
+
+  if (!thread_command)
+    return;
+
+  priv = thread_command->pool->priv;
+  run_time = g_get_monotonic_time () - start_time;
+  name = g_strconcat (thread_command->name, ":", phase, NULL);
+
+  g_mutex_lock (&priv->mutex);
+  stats = get_stats (priv, name);
+  stats->count++;
+  stats->run_time += run_time;
+  stats->max_run_time = MAX (stats->max_run_time, run_time);
+  g_mutex_unlock (&priv->mutex);
+
+  g_free (name);
+}
+
+static void
+append_stats (const gchar  *name,
+              CommandStats *stats,
+              GString      *string)
+{
+  guint count = MAX (stats->count, 1);
+
+  g_string_append_printf (string,
+                          "  %s: %u runs, %u cancelled, %u failed, "
+                          "wait avg %" G_GINT64_FORMAT " ms max %" G_GINT64_FORMAT " ms, "
+                          "run avg %" G_GINT64_FORMAT " ms max %" G_GINT64_FORMAT " ms\n",
+                          name,
+                          stats->count,
+                          stats->cancelled,
+                          stats->failed,
+                          stats->wait_time / count / 1000,
+                          stats->max_wait_time / 1000,
+                          stats->run_time / count / 1000,
+                          stats->max_run_time / 1000);
+}
+
+/**
+ * hd_command_thread_pool_get_statistics:
+ *
+ * Returns the queue depth and per command type counters of all pools in
+ * a human readable form.
+ *
+ * Returns: a newly allocated string
+ */
+gchar *
+hd_command_thread_pool_get_statistics (void)
+{
+  GString *string = g_string_new (NULL);
+  GSList *l;
+
+  G_LOCK (pools);
+
+  for (l = pools; l; l = l->next)
+    {
+      HDCommandThreadPoolPrivate *priv = HD_COMMAND_THREAD_POOL (l->data)->priv;
+      guint queued;
+
+      g_mutex_lock (&priv->mutex);
+
+      queued = g_hash_table_size (priv->queued);
+      g_string_append_printf (string,
+                              "%s: %u workers, %u queued, %u running\n",
+                              priv->name ? priv->name : "pool",
+                              priv->max_threads,
+                              queued,
+                              priv->outstanding - queued);
+      g_hash_table_foreach (priv->stats,
+                            (GHFunc) append_stats,
+                            string);
+
+      g_mutex_unlock (&priv->mutex);
+    }
+
+  G_UNLOCK (pools);
+
+  return g_string_free (string, FALSE);
+}
@@ -52,20 +52,62 @@ struct _HDCommandThreadPoolClass
 
 typedef void (*HDCommandCallback) (gpointer data);
 
+/**
+ * HDCommandPriority:
+ * @HD_COMMAND_PRIORITY_CURRENT_VIEW: work for the currently visible view
+ * @HD_COMMAND_PRIORITY_OTHER_VIEWS: work for other views, the default
+ * @HD_COMMAND_PRIORITY_SPECULATIVE: work which might not be needed at all
+ *
+ * Lanes of a #HDCommandThreadPool, commands in earlier lanes are started
+ * first.
+ */
+typedef enum
+{
+  HD_COMMAND_PRIORITY_CURRENT_VIEW,
+  HD_COMMAND_PRIORITY_OTHER_VIEWS,
+  HD_COMMAND_PRIORITY_SPECULATIVE
+} HDCommandPriority;
+
+#define HD_COMMAND_PRIORITY_DEFAULT HD_COMMAND_PRIORITY_OTHER_VIEWS
+
 GType                hd_command_thread_pool_get_type  (void);
 
 HDCommandThreadPool *hd_command_thread_pool_new       (void);
+HDCommandThreadPool *hd_command_thread_pool_new_full  (guint                max_threads);
+void                 hd_command_thread_pool_set_name  (HDCommandThreadPool *pool,
+                                                       const gchar         *name);
+void                 hd_command_thread_pool_set_max_threads (HDCommandThreadPool *pool,
+                                                             guint                max_threads);
 
 void                 hd_command_thread_pool_push      (HDCommandThreadPool *pool,
                                                        HDCommandCallback    command,
                                                        gpointer             data,
                                                        GDestroyNotify       destroy_data);
+guint                hd_command_thread_pool_push_full (HDCommandThreadPool *pool,
+                                                       HDCommandPriority    priority,
+                                                       const gchar         *name,
+                                                       HDCommandCallback    command,
+                                                       gpointer             data,
+                                                       GDestroyNotify       destroy_data);
+gboolean             hd_command_thread_pool_set_priority (HDCommandThreadPool *pool,
+                                                          guint                id,
+                                                          HDCommandPriority    priority);
+gboolean             hd_command_thread_pool_remove    (HDCommandThreadPool *pool,
+                                                       guint                id);
 void                 hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                                        gint                 priority,
                                                        GSourceFunc          function,
                                                        gpointer             data,
                                                        GDestroyNotify       destroy_data);
 
+/* The following functions can be called from the command callback */
+void                 hd_command_thread_pool_command_cancelled (void);
+void                 hd_command_thread_pool_command_failed    (void);
+void                 hd_command_thread_pool_record_phase      (const gchar *phase,
+                                                               gint64       start_time);
+
+gchar               *hd_command_thread_pool_get_statistics    (void);
+
 G_END_DECLS
 
 #endif /* __HD_COMMAND_THREAD_POOL_H__ */
@@ -47,6 +47,7 @@ enum
 typedef struct
 {
   GFile *file;
+  HDBackgroundsSource *source;
   guint  view;
   GCancellable *cancellable;
   gboolean error_dialogs;
@@ -126,21 +127,28 @@ hd_file_background_set_for_view_full (HDFileBackground *background,
                                       gboolean          update_gconf)
 {
   HDFileBackgroundPrivate *priv = HD_FILE_BACKGROUND (background)->priv;
+  GCancellable *job_cancellable;
   CommandData *data;
 
+  job_cancellable = hd_backgrounds_job_cancellable_new (cancellable);
+
   data = command_data_new (priv->image_file,
                            current_view,
-                           cancellable,
+                           job_cancellable,
                            error_dialogs,
                            update_gconf);
 
   hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
                                           priv->image_file,
+                                          current_view,
                                           data->error_dialogs,
-                                          cancellable,
+                                          data->update_gconf,
+                                          job_cancellable,
                                           (HDCommandCallback) create_cached_image_command,
                                           data,
                                           (GDestroyNotify) command_data_free);
+
+  g_object_unref (job_cancellable);
 }
 
 static GFile *
@@ -163,11 +171,37 @@ create_cached_image_command (CommandData *data)
   if (g_cancellable_is_cancelled (data->cancellable))
     goto cleanup;
 
-  pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (data->file,
-                                                    &screen_size,
-                                                    &etag,
-                                                    data->cancellable,
-                                                    &error);
+  /* Rendered before, e.g. when switching back to a previous background */
+  if (hd_backgrounds_source_link_rendered_image (data->source,
+                                                 &screen_size,
+                                                 data->view,
+                                                 data->update_gconf,
+                                                 data->cancellable))
+    goto cleanup;
+
+  /* Rendered ahead while the user was choosing it */
+  pixbuf = hd_backgrounds_source_get_prerendered (data->source,
+                                                  data->view,
+                                                  &screen_size,
+                                                  &etag);
+
+  if (!pixbuf)
+    {
+      /* Show a low quality version of large images until it is done,
+       * unless another view already decoded the image at this size */
+      if (!hd_backgrounds_source_is_decoded (data->source,
+                                             &screen_size))
+        hd_backgrounds_source_publish_preview (data->source,
+                                               &screen_size,
+                                               data->view,
+                                               data->cancellable);
+
+      pixbuf = hd_backgrounds_source_load_scaled_and_cropped (data->source,
+                                                              &screen_size,
+                                                              &etag,
+                                                              data->cancellable,
+                                                              &error);
+    }
   if (error)
     {
       char *uri;
@@ -182,6 +216,7 @@ create_cached_image_command (CommandData *data)
                  error->message);
       g_free (uri);
       g_error_free (error);
+      hd_command_thread_pool_command_failed ();
       goto cleanup;
     }
 
@@ -191,20 +226,31 @@ create_cached_image_command (CommandData *data)
   if (g_cancellable_is_cancelled (data->cancellable))
     goto cleanup;
 
-  hd_backgrounds_save_cached_image (hd_backgrounds_get (),
-                                    pixbuf,
-                                    data->view,
-                                    data->file,
-                                    etag,
-                                    data->error_dialogs,
-                                    data->update_gconf,
-                                    data->cancellable,
-                                    &error);
+  hd_backgrounds_source_save_cached_image (data->source,
+                                           pixbuf,
+                                           data->view,
+                                           etag,
+                                           data->error_dialogs,
+                                           data->update_gconf,
+                                           data->cancellable,
+                                           &error);
 
   if (error)
-    g_error_free (error);
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        hd_command_thread_pool_command_failed ();
+      g_error_free (error);
+    }
 
 cleanup:
+  /* Never leave the preview if the image was not saved */
+  hd_backgrounds_source_finish_preview (data->source,
+                                        data->view,
+                                        data->cancellable);
+
+  if (g_cancellable_is_cancelled (data->cancellable))
+    hd_command_thread_pool_command_cancelled ();
+
   if (pixbuf)
     g_object_unref (pixbuf);
   g_free (etag);
@@ -325,6 +371,7 @@ command_data_new  (GFile        *file,
   CommandData *data = g_slice_new0 (CommandData);
 
   data->file = g_object_ref (file);
+  data->source = hd_backgrounds_source_ref (hd_backgrounds_get (), file);
   data->view = view;
   data->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
 
@@ -341,6 +388,7 @@ command_data_free (CommandData *data)
     return;
 
   g_object_unref (data->file);
+  hd_backgrounds_source_unref (data->source);
 
   if (data->cancellable)
     g_object_unref (data->cancellable);
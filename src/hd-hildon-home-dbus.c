@@ -36,6 +36,7 @@
 #include <libosso.h>
 
 #include "hd-backgrounds.h"
+#include "hd-command-thread-pool.h"
 #include "hd-edit-mode-menu.h"
 
 #include "hd-hildon-home-dbus.h"
@@ -228,3 +229,14 @@ hd_hildon_home_dbus_set_background_image (HDHildonHomeDBus      *dbus,
                                          uri);
   dbus_g_method_return (context);
 }
+
+void
+hd_hildon_home_dbus_get_worker_statistics (HDHildonHomeDBus      *dbus,
+                                           DBusGMethodInvocation *context)
+{
+  gchar *statistics;
+
+  statistics = hd_command_thread_pool_get_statistics ();
+  dbus_g_method_return (context, statistics);
+  g_free (statistics);
+}
@@ -0,0 +1,413 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "hd-icon-cache.h"
+
+#include "hd-command-thread-pool.h"
+
+#define HD_ICON_CACHE_GET_PRIVATE(object) \
+  (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_ICON_CACHE, HDIconCachePrivate))
+
+struct _HDIconCachePrivate
+{
+  /* "size:icon-name" -> GdkPixbuf */
+  GHashTable *table;
+  /* keys which are currently decoded in the thread pool */
+  GHashTable *pending;
+
+  /* IconRequests which are preloaded again after theme changes */
+  GPtrArray *preloads;
+
+  HDCommandThreadPool *thread_pool;
+
+  /* Increased on theme change to drop results from the old theme */
+  guint generation;
+};
+
+typedef struct
+{
+  gchar *icon_name;
+  gint   size;
+} IconRequest;
+
+typedef struct
+{
+  HDIconCache *cache;
+  gchar       *key;
+  gchar       *filename;
+  gint         size;
+  guint        generation;
+  GdkPixbuf   *pixbuf;
+} IconLoad;
+
+G_DEFINE_TYPE (HDIconCache, hd_icon_cache, G_TYPE_OBJECT);
+
+static gchar *
+icon_cache_key (const gchar *icon_name,
+                gint         size)
+{
+  return g_strdup_printf ("%d:%s", size, icon_name);
+}
+
+static gboolean
+icon_cache_is_preloaded (HDIconCache *cache,
+                         const gchar *icon_name,
+                         gint         size)
+{
+  HDIconCachePrivate *priv = cache->priv;
+  guint i;
+
+  for (i = 0; i < priv->preloads->len; i++)
+    {
+      IconRequest *request = g_ptr_array_index (priv->preloads, i);
+
+      if (request->size == size &&
+          !g_strcmp0 (request->icon_name, icon_name))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+icon_request_free (IconRequest *request)
+{
+  g_free (request->icon_name);
+  g_slice_free (IconRequest, request);
+}
+
+static void
+icon_load_free (IconLoad *load)
+{
+  g_object_unref (load->cache);
+  g_free (load->key);
+  g_free (load->filename);
+  if (load->pixbuf)
+    g_object_unref (load->pixbuf);
+
+  g_slice_free (IconLoad, load);
+}
+
+static gboolean
+icon_load_finished (IconLoad *load)
+{
+  HDIconCachePrivate *priv = load->cache->priv;
+
+  /* Results of loads started before a theme change are dropped */
+  if (load->generation != priv->generation)
+    return FALSE;
+
+  g_hash_table_remove (priv->pending, load->key);
+
+  if (load->pixbuf &&
+      !g_hash_table_lookup (priv->table, load->key))
+    g_hash_table_insert (priv->table,
+                         g_strdup (load->key),
+                         g_object_ref (load->pixbuf));
+
+  return FALSE;
+}
+
+/* Runs in the thread pool */
+static void
+icon_load_execute (IconLoad *load)
+{
+  GError *error = NULL;
+
+  load->pixbuf = gdk_pixbuf_new_from_file_at_size (load->filename,
+                                                   load->size,
+                                                   load->size,
+                                                   &error);
+  if (error)
+    {
+      g_debug ("%s. Could not load icon %s. %s",
+               __FUNCTION__,
+               load->filename,
+               error->message);
+      g_error_free (error);
+    }
+
+  gdk_threads_add_idle_full (G_PRIORITY_DEFAULT_IDLE,
+                             (GSourceFunc) icon_load_finished,
+                             load,
+                             (GDestroyNotify) icon_load_free);
+}
+
+static void
+icon_cache_start_load (HDIconCache *cache,
+                       const gchar *icon_name,
+                       gint         size)
+{
+  HDIconCachePrivate *priv = cache->priv;
+  GtkIconInfo *info;
+  IconLoad *load;
+  gchar *key;
+
+  key = icon_cache_key (icon_name, size);
+
+  if (g_hash_table_lookup (priv->table, key) ||
+      g_hash_table_lookup (priv->pending, key))
+    {
+      g_free (key);
+      return;
+    }
+
+  /* The theme lookup itself is cheap and not thread safe, only the
+   * decoding is done in the thread pool */
+  info = gtk_icon_theme_lookup_icon (gtk_icon_theme_get_default (),
+                                     icon_name,
+                                     size,
+                                     GTK_ICON_LOOKUP_NO_SVG);
+  if (!info)
+    {
+      g_debug ("%s. Could not find icon %s in theme",
+               __FUNCTION__,
+               icon_name);
+      g_free (key);
+      return;
+    }
+
+  load = g_slice_new0 (IconLoad);
+  load->cache = g_object_ref (cache);
+  load->key = key;
+  load->filename = g_strdup (gtk_icon_info_get_filename (info));
+  load->size = size;
+  load->generation = priv->generation;
+  g_object_unref (info);
+
+  if (!load->filename)
+    {
+      icon_load_free (load);
+      return;
+    }
+
+  g_hash_table_insert (priv->pending,
+                       g_strdup (key),
+                       GINT_TO_POINTER (TRUE));
+
+  hd_command_thread_pool_push (priv->thread_pool,
+                               (HDCommandCallback) icon_load_execute,
+                               load,
+                               NULL);
+}
+
+static void
+icon_theme_changed (GtkIconTheme *icon_theme,
+                    HDIconCache  *cache)
+{
+  HDIconCachePrivate *priv = cache->priv;
+  guint i;
+
+  priv->generation++;
+
+  g_hash_table_remove_all (priv->table);
+  g_hash_table_remove_all (priv->pending);
+
+  for (i = 0; i < priv->preloads->len; i++)
+    {
+      IconRequest *request = g_ptr_array_index (priv->preloads, i);
+
+      icon_cache_start_load (cache,
+                             request->icon_name,
+                             request->size);
+    }
+}
+
+static void
+hd_icon_cache_dispose (GObject *object)
+{
+  HDIconCachePrivate *priv = HD_ICON_CACHE (object)->priv;
+
+  g_signal_handlers_disconnect_by_func (gtk_icon_theme_get_default (),
+                                        icon_theme_changed,
+                                        object);
+
+  if (priv->thread_pool)
+    priv->thread_pool = (g_object_unref (priv->thread_pool), NULL);
+
+  if (priv->table)
+    priv->table = (g_hash_table_destroy (priv->table), NULL);
+
+  if (priv->pending)
+    priv->pending = (g_hash_table_destroy (priv->pending), NULL);
+
+  if (priv->preloads)
+    priv->preloads = (g_ptr_array_free (priv->preloads, TRUE), NULL);
+
+  G_OBJECT_CLASS (hd_icon_cache_parent_class)->dispose (object);
+}
+
+static void
+hd_icon_cache_class_init (HDIconCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = hd_icon_cache_dispose;
+
+  g_type_class_add_private (klass, sizeof (HDIconCachePrivate));
+}
+
+static void
+hd_icon_cache_init (HDIconCache *cache)
+{
+  HDIconCachePrivate *priv = HD_ICON_CACHE_GET_PRIVATE (cache);
+
+  cache->priv = priv;
+
+  priv->table = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free,
+                                       (GDestroyNotify) g_object_unref);
+  priv->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free,
+                                         NULL);
+  priv->preloads = g_ptr_array_new_with_free_func ((GDestroyNotify) icon_request_free);
+
+  priv->thread_pool = hd_command_thread_pool_new ();
+  hd_command_thread_pool_set_name (priv->thread_pool, "icon-cache");
+
+  g_signal_connect (gtk_icon_theme_get_default (), "changed",
+                    G_CALLBACK (icon_theme_changed), cache);
+}
+
+HDIconCache *
+hd_icon_cache_get (void)
+{
+  static HDIconCache *cache = NULL;
+
+  if (G_UNLIKELY (!cache))
+    cache = g_object_new (HD_TYPE_ICON_CACHE,
+                          NULL);
+
+  return cache;
+}
+
+/**
+ * hd_icon_cache_lookup:
+ * @cache: a #HDIconCache
+ * @icon_name: the icon name in the current theme
+ * @size: the size in pixels
+ *
+ * Returns the cached icon. If a preloaded icon was not decoded yet it is
+ * loaded synchronously and added to the cache. Icons which were never
+ * preloaded are not cached.
+ *
+ * Returns: a new reference to the icon or %NULL if it was not preloaded or
+ * could not be loaded
+ */
+GdkPixbuf *
+hd_icon_cache_lookup (HDIconCache *cache,
+                      const gchar *icon_name,
+                      gint         size)
+{
+  HDIconCachePrivate *priv;
+  GdkPixbuf *pixbuf;
+  gchar *key;
+
+  g_return_val_if_fail (HD_IS_ICON_CACHE (cache), NULL);
+  g_return_val_if_fail (icon_name, NULL);
+
+  priv = cache->priv;
+
+  key = icon_cache_key (icon_name, size);
+
+  pixbuf = g_hash_table_lookup (priv->table,
+                                key);
+
+  if (!pixbuf)
+    {
+      GError *error = NULL;
+
+      /* Names coming with notifications are arbitrary, so only preloaded
+       * icons are kept in the cache */
+      if (!icon_cache_is_preloaded (cache, icon_name, size))
+        {
+          g_free (key);
+          return NULL;
+        }
+
+      pixbuf = gtk_icon_theme_load_icon (gtk_icon_theme_get_default (),
+                                         icon_name,
+                                         size,
+                                         GTK_ICON_LOOKUP_NO_SVG,
+                                         &error);
+      if (error)
+        {
+          g_debug ("%s. Could not load icon %s from theme. %s",
+                   __FUNCTION__,
+                   icon_name,
+                   error->message);
+          g_error_free (error);
+        }
+
+      if (!pixbuf)
+        {
+          g_free (key);
+          return NULL;
+        }
+
+      /* A pending preload of the same icon is superseded */
+      g_hash_table_insert (priv->table,
+                           key,
+                           pixbuf);
+    }
+  else
+    g_free (key);
+
+  return g_object_ref (pixbuf);
+}
+
+/**
+ * hd_icon_cache_preload:
+ * @cache: a #HDIconCache
+ * @icon_name: the icon name in the current theme
+ * @size: the size in pixels
+ *
+ * Decodes the icon in a worker thread and adds it to the cache. The icon
+ * is preloaded again when the icon theme changes.
+ */
+void
+hd_icon_cache_preload (HDIconCache *cache,
+                       const gchar *icon_name,
+                       gint         size)
+{
+  HDIconCachePrivate *priv;
+  IconRequest *request;
+
+  g_return_if_fail (HD_IS_ICON_CACHE (cache));
+  g_return_if_fail (icon_name);
+
+  priv = cache->priv;
+
+  if (!icon_cache_is_preloaded (cache, icon_name, size))
+    {
+      request = g_slice_new (IconRequest);
+      request->icon_name = g_strdup (icon_name);
+      request->size = size;
+      g_ptr_array_add (priv->preloads, request);
+    }
+
+  icon_cache_start_load (cache, icon_name, size);
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_ICON_CACHE_H__
+#define __HD_ICON_CACHE_H__
+
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+#define HD_TYPE_ICON_CACHE             (hd_icon_cache_get_type ())
+#define HD_ICON_CACHE(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), HD_TYPE_ICON_CACHE, HDIconCache))
+#define HD_ICON_CACHE_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST ((klass), HD_TYPE_ICON_CACHE, HDIconCacheClass))
+#define HD_IS_ICON_CACHE(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), HD_TYPE_ICON_CACHE))
+#define HD_IS_ICON_CACHE_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), HD_TYPE_ICON_CACHE))
+#define HD_ICON_CACHE_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS ((obj), HD_TYPE_ICON_CACHE, HDIconCacheClass))
+
+typedef struct _HDIconCache        HDIconCache;
+typedef struct _HDIconCacheClass   HDIconCacheClass;
+typedef struct _HDIconCachePrivate HDIconCachePrivate;
+
+/** HDIconCache:
+ *
+ * A cache of decoded theme icons keyed by icon name and pixel size
+ */
+struct _HDIconCache
+{
+  GObject parent;
+
+  HDIconCachePrivate *priv;
+};
+
+struct _HDIconCacheClass
+{
+  GObjectClass parent;
+};
+
+GType        hd_icon_cache_get_type (void);
+
+HDIconCache *hd_icon_cache_get      (void);
+GdkPixbuf   *hd_icon_cache_lookup   (HDIconCache *cache,
+                                     const gchar *icon_name,
+                                     gint         size);
+void         hd_icon_cache_preload  (HDIconCache *cache,
+                                     const gchar *icon_name,
+                                     gint         size);
+
+G_END_DECLS
+
+#endif
@@ -51,6 +51,7 @@ enum
 typedef struct
 {
   GFile *file;
+  HDBackgroundsSource *source;
   guint  view;
   GCancellable *cancellable;
 } CommandData;
@@ -140,18 +141,26 @@ hd_imageset_background_set_for_current_view (HDBackground   *background,
     {
       GFile *image_file = hd_object_vector_at (priv->image_files,
                                                view);
+      GCancellable *job_cancellable;
+
+      /* Each view can be superseded on its own */
+      job_cancellable = hd_backgrounds_job_cancellable_new (cancellable);
 
       data = command_data_new (image_file,
                                view,
-                               cancellable);
+                               job_cancellable);
 
       hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
                                               image_file,
+                                              view,
                                               error_dialogs,
-                                              cancellable,
+                                              TRUE,
+                                              job_cancellable,
                                               (HDCommandCallback) create_cached_image_command,
                                               data,
                                               (GDestroyNotify) command_data_free);
+
+      g_object_unref (job_cancellable);
     }
 }
 
@@ -168,11 +177,37 @@ create_cached_image_command (CommandData *data)
   if (g_cancellable_is_cancelled (data->cancellable))
     goto cleanup;
 
-  pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (data->file,
-                                                    &screen_size,
-                                                    &etag,
-                                                    data->cancellable,
-                                                    &error);
+  /* Rendered before, e.g. when switching back to a previous background */
+  if (hd_backgrounds_source_link_rendered_image (data->source,
+                                                 &screen_size,
+                                                 data->view,
+                                                 update_gconf,
+                                                 data->cancellable))
+    goto cleanup;
+
+  /* Rendered ahead while the user was choosing it */
+  pixbuf = hd_backgrounds_source_get_prerendered (data->source,
+                                                  data->view,
+                                                  &screen_size,
+                                                  &etag);
+
+  if (!pixbuf)
+    {
+      /* Show a low quality version of large images until it is done,
+       * unless another view already decoded the image at this size */
+      if (!hd_backgrounds_source_is_decoded (data->source,
+                                             &screen_size))
+        hd_backgrounds_source_publish_preview (data->source,
+                                               &screen_size,
+                                               data->view,
+                                               data->cancellable);
+
+      pixbuf = hd_backgrounds_source_load_scaled_and_cropped (data->source,
+                                                              &screen_size,
+                                                              &etag,
+                                                              data->cancellable,
+                                                              &error);
+    }
   if (error)
     {
       char *uri;
@@ -187,6 +222,7 @@ create_cached_image_command (CommandData *data)
                  error->message);
       g_free (uri);
       g_error_free (error);
+      hd_command_thread_pool_command_failed ();
       goto cleanup;
     }
 
@@ -196,20 +232,31 @@ create_cached_image_command (CommandData *data)
   if (g_cancellable_is_cancelled (data->cancellable))
     goto cleanup;
   
-  hd_backgrounds_save_cached_image (hd_backgrounds_get (),
-                                    pixbuf,
-                                    data->view,
-                                    data->file,
-                                    etag,
-                                    error_dialogs,
-                                    update_gconf,
-                                    data->cancellable,
-                                    &error);
+  hd_backgrounds_source_save_cached_image (data->source,
+                                           pixbuf,
+                                           data->view,
+                                           etag,
+                                           error_dialogs,
+                                           update_gconf,
+                                           data->cancellable,
+                                           &error);
 
   if (error)
-    g_error_free (error);
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        hd_command_thread_pool_command_failed ();
+      g_error_free (error);
+    }
 
 cleanup:
+  /* Never leave the preview if the image was not saved */
+  hd_backgrounds_source_finish_preview (data->source,
+                                        data->view,
+                                        data->cancellable);
+
+  if (g_cancellable_is_cancelled (data->cancellable))
+    hd_command_thread_pool_command_cancelled ();
+
   if (pixbuf)
     g_object_unref (pixbuf);
   g_free (etag);
@@ -221,6 +268,10 @@ hd_imageset_background_get_image_file_for_view (HDBackground *background,
 {
   HDImagesetBackgroundPrivate *priv = HD_IMAGESET_BACKGROUND (background)->priv;
 
+  /* Imagesets may come without portrait images */
+  if (view >= hd_object_vector_size (priv->image_files))
+    return NULL;
+
   return hd_object_vector_at (priv->image_files, view);
 }
 
@@ -628,6 +679,7 @@ command_data_new  (GFile        *file,
   CommandData *data = g_slice_new0 (CommandData);
 
   data->file = g_object_ref (file);
+  data->source = hd_backgrounds_source_ref (hd_backgrounds_get (), file);
   data->view = view;
   data->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
 
@@ -641,6 +693,7 @@ command_data_free (CommandData *data)
     return;
 
   g_object_unref (data->file);
+  hd_backgrounds_source_unref (data->source);
 
   if (data->cancellable)
     g_object_unref (data->cancellable);
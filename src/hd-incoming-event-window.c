@@ -33,6 +33,7 @@
 #include <X11/Xatom.h>
 
 #include "hd-cairo-surface-cache.h"
+#include "hd-icon-cache.h"
 #include "hd-incoming-event-window.h"
 #include "hd-incoming-events.h"
 #include "hd-time-difference.h"
@@ -88,6 +89,7 @@ struct _HDIncomingEventWindowPrivate
 {
   gboolean preview;
   gchar *destination;
+  gchar *icon_name;
 
   GtkWidget *icon;
   GtkWidget *title;
@@ -100,7 +102,7 @@ struct _HDIncomingEventWindowPrivate
 
   guint timeout_id;
 
-  guint update_time_source;
+  guint time_watch;
 
   cairo_surface_t *bg_image;
 };
@@ -215,33 +217,32 @@ hd_incoming_event_window_set_string_xwindow_property (GtkWidget *widget,
 /*
  * Update the displayed relative time in the task switcher notification thumbnail window
  */
-static gboolean
-hd_incoming_event_window_update_time (HDIncomingEventWindow *window)
+static void
+hd_incoming_event_window_time_changed (const gchar           *time_text,
+                                       HDIncomingEventWindow *window)
 {
-  HDIncomingEventWindowPrivate *priv = window->priv;
-  time_t current_time, difference, timeout;
-  gchar *time_text;
-
-  time (&current_time);
-
-  difference = current_time - priv->time;
-
-  time_text = hd_time_difference_get_text (difference);
-  timeout = hd_time_difference_get_timeout (difference);
-
   hd_incoming_event_window_set_string_xwindow_property (GTK_WIDGET (window),
                                                         "_HILDON_INCOMING_EVENT_NOTIFICATION_TIME",
                                                         time_text);
-  if (priv->update_time_source)
-    priv->update_time_source = (g_source_remove (priv->update_time_source), 0);
+}
 
-  priv->update_time_source = g_timeout_add_seconds (timeout,
-                                                    (GSourceFunc) hd_incoming_event_window_update_time,
-                                                    window);
+/*
+ * (Re-)register the window on the shared relative time ticker
+ */
+static void
+hd_incoming_event_window_update_time (HDIncomingEventWindow *window)
+{
+  HDIncomingEventWindowPrivate *priv = window->priv;
 
-  g_free (time_text);
+  if (priv->time_watch)
+    priv->time_watch = (hd_time_difference_remove_watch (priv->time_watch), 0);
 
-  return FALSE;
+  if (priv->preview)
+    return;
+
+  priv->time_watch = hd_time_difference_add_watch (priv->time,
+                                                   (HDTimeDifferenceFunc) hd_incoming_event_window_time_changed,
+                                                   window);
 }
 
 static void
@@ -266,16 +267,49 @@ hd_incoming_event_window_update_title_and_amount (HDIncomingEventWindow *window)
   g_free (title);
 }
 
+/*
+ * Use the decoded icon shared by all windows if available, else let
+ * the image resolve the icon name itself
+ */
+static void
+hd_incoming_event_window_update_icon (HDIncomingEventWindow *window)
+{
+  HDIncomingEventWindowPrivate *priv = window->priv;
+  GdkPixbuf *pixbuf = NULL;
+
+  if (priv->icon_name)
+    pixbuf = hd_icon_cache_lookup (hd_icon_cache_get (),
+                                   priv->icon_name,
+                                   HILDON_ICON_PIXEL_SIZE_STYLUS);
+
+  if (pixbuf)
+    {
+      gtk_image_set_from_pixbuf (GTK_IMAGE (priv->icon), pixbuf);
+      g_object_unref (pixbuf);
+    }
+  else
+    gtk_image_set_from_icon_name (GTK_IMAGE (priv->icon),
+                                  priv->icon_name,
+                                  HILDON_ICON_SIZE_STYLUS);
+}
+
+static cairo_pattern_t *
+get_transparent_pattern (void)
+{
+  static cairo_pattern_t *pattern = NULL;
+
+  if (G_UNLIKELY (!pattern))
+    pattern = cairo_pattern_create_rgba (0.0, 0.0, 0.0, 0.0);
+
+  return pattern;
+}
+
 static void
 hd_incoming_event_window_realize (GtkWidget *widget)
 {
   HDIncomingEventWindowPrivate *priv = HD_INCOMING_EVENT_WINDOW (widget)->priv;
   GdkScreen *screen;
-  const gchar *notification_type, *icon;
-  GtkIconSize icon_size;
-  cairo_surface_t *pixmap;
-  cairo_pattern_t *pattern;
-  cairo_t *cr;
+  const gchar *notification_type;
 
   screen = gtk_widget_get_screen (widget);
   gtk_widget_set_visual (widget,
@@ -302,10 +336,9 @@ hd_incoming_event_window_realize (GtkWidget *widget)
 
   /* Assume the properties have already been set.  Earlier these X window
    * properties couldn't be set because we weren't realized. */
-  gtk_image_get_icon_name (GTK_IMAGE (priv->icon), &icon, &icon_size);
   hd_incoming_event_window_set_string_xwindow_property (widget,
                              "_HILDON_INCOMING_EVENT_NOTIFICATION_ICON",
-                             icon);
+                             priv->icon_name);
   hd_incoming_event_window_set_string_xwindow_property (widget,
                           "_HILDON_INCOMING_EVENT_NOTIFICATION_SUMMARY",
                           gtk_label_get_text (GTK_LABEL (priv->title)));
@@ -317,25 +350,12 @@ hd_incoming_event_window_realize (GtkWidget *widget)
                           priv->destination);
 
   /* Update time of nopreview windows */
-  if (!priv->preview && hd_incoming_events_get_display_on ())
-    hd_incoming_event_window_update_time (HD_INCOMING_EVENT_WINDOW (widget));
+  hd_incoming_event_window_update_time (HD_INCOMING_EVENT_WINDOW (widget));
   hd_incoming_event_window_update_title_and_amount (HD_INCOMING_EVENT_WINDOW (widget));
 
-  /* Set background to transparent pixmap */
-  //TODO NOT SURE THIS IS RIGHT
-  GdkWindow* window = gtk_widget_get_window(widget);
-  pixmap = gdk_window_create_similar_surface(window, CAIRO_CONTENT_COLOR_ALPHA, gdk_window_get_width(window), gdk_window_get_height(window));
-  cr = cairo_create (pixmap);
-  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-  cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 0.0);
-  cairo_paint (cr);
-  cairo_destroy (cr);
-
-  pattern = cairo_pattern_create_for_surface (pixmap);
-  cairo_surface_destroy (pixmap);
-
-  gdk_window_set_background_pattern(window, pattern);
-  cairo_pattern_destroy (pattern);
+  /* Set background to a transparent pattern shared by all windows */
+  gdk_window_set_background_pattern (gtk_widget_get_window (widget),
+                                     get_transparent_pattern ());
 }
 
 #ifdef DEAD_CODE
@@ -373,16 +393,13 @@ hd_incoming_event_window_draw_signal (GtkWidget *widget,
 {
   HDIncomingEventWindowPrivate *priv = HD_INCOMING_EVENT_WINDOW (widget)->priv;
 
+  /* The window is exactly the size of the background, blit it directly */
   cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-
-  cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 0.0);
+  cairo_set_source_surface (cr, priv->bg_image, 0.0, 0.0);
   cairo_paint (cr);
 
   cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
 
-  cairo_set_source_surface (cr, priv->bg_image, 0.0, 0.0);
-  cairo_paint (cr);
-
   return GTK_WIDGET_CLASS (hd_incoming_event_window_parent_class)->draw (widget,
                                                                          cr);
 }
@@ -392,14 +409,18 @@ hd_incoming_event_window_dispose (GObject *object)
 {
   HDIncomingEventWindowPrivate *priv = HD_INCOMING_EVENT_WINDOW (object)->priv;
 
+  g_signal_handlers_disconnect_by_func (gtk_icon_theme_get_default (),
+                                        hd_incoming_event_window_update_icon,
+                                        object);
+
   if (priv->timeout_id)
     {
       g_source_remove (priv->timeout_id);
       priv->timeout_id = 0;
     }
 
-  if (priv->update_time_source)
-    priv->update_time_source = (g_source_remove (priv->update_time_source), 0);
+  if (priv->time_watch)
+    priv->time_watch = (hd_time_difference_remove_watch (priv->time_watch), 0);
 
   if (priv->bg_image)
     priv->bg_image = (cairo_surface_destroy (priv->bg_image), NULL);
@@ -413,6 +434,7 @@ hd_incoming_event_window_finalize (GObject *object)
   HDIncomingEventWindowPrivate *priv = HD_INCOMING_EVENT_WINDOW (object)->priv;
 
   priv->destination = (g_free (priv->destination), NULL);
+  priv->icon_name = (g_free (priv->icon_name), NULL);
 
   G_OBJECT_CLASS (hd_incoming_event_window_parent_class)->finalize (object);
 }
@@ -436,13 +458,7 @@ hd_incoming_event_window_get_property (GObject      *object,
       break;
 
     case PROP_ICON:
-        {
-          const gchar *icon_name;
-          
-          gtk_image_get_icon_name (GTK_IMAGE (priv->icon), &icon_name, NULL);
-
-          g_value_set_string (value, icon_name);
-        }
+      g_value_set_string (value, priv->icon_name);
       break;
 
     case PROP_TITLE:
@@ -492,13 +508,13 @@ hd_incoming_event_window_set_property (GObject      *object,
       break;
 
     case PROP_ICON:
-      gtk_image_set_from_icon_name (GTK_IMAGE (priv->icon),
-                                    g_value_get_string (value),
-                                    HILDON_ICON_SIZE_STYLUS);
+      g_free (priv->icon_name);
+      priv->icon_name = g_value_dup_string (value);
+      hd_incoming_event_window_update_icon (HD_INCOMING_EVENT_WINDOW (object));
       hd_incoming_event_window_set_string_xwindow_property (
                              GTK_WIDGET (object),
                              "_HILDON_INCOMING_EVENT_NOTIFICATION_ICON",
-                             g_value_get_string (value));
+                             priv->icon_name);
       break;
 
     case PROP_TITLE:
@@ -508,8 +524,7 @@ hd_incoming_event_window_set_property (GObject      *object,
 
     case PROP_TIME:
       priv->time = g_value_get_long (value);
-      if (!priv->preview && hd_incoming_events_get_display_on ())
-        hd_incoming_event_window_update_time (HD_INCOMING_EVENT_WINDOW (object));
+      hd_incoming_event_window_update_time (HD_INCOMING_EVENT_WINDOW (object));
       break;
 
     case PROP_AMOUNT:
@@ -635,32 +650,12 @@ hd_incoming_event_window_class_init (HDIncomingEventWindowClass *klass)
   g_type_class_add_private (klass, sizeof (HDIncomingEventWindowPrivate));
 }
 
-static void
-display_status_changed (HDIncomingEvents      *ie,
-                        gboolean               display_on,
-                        HDIncomingEventWindow *window)
-{
-  HDIncomingEventWindowPrivate *priv = window->priv;
-
-  if (priv->preview)
-    return;
-
-  if (display_on)
-    {
-      hd_incoming_event_window_update_time (window);
-    }
-  else
-    {
-      if (priv->update_time_source)
-        priv->update_time_source = (g_source_remove (priv->update_time_source), 0);
-    }
-}
-
 static void
 hd_incoming_event_window_init (HDIncomingEventWindow *window)
 {
   HDIncomingEventWindowPrivate *priv = HD_INCOMING_EVENT_WINDOW_GET_PRIVATE (window);
   GtkWidget *main_table;
+  gint width, height;
 
   window->priv = priv;
 
@@ -731,16 +726,22 @@ hd_incoming_event_window_init (HDIncomingEventWindow *window)
   /* Don't take focus away from the toplevel application. */
   gtk_window_set_accept_focus (GTK_WINDOW (window), FALSE);
 
-  /* bg image */
+  /* bg image, shared by all incoming event windows */
   priv->bg_image = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
                                                        BACKGROUND_IMAGE_FILE);
-
-  g_signal_connect_object (hd_incoming_events_get (), "display-status-changed",
-                           G_CALLBACK (display_status_changed), window, 0);
+  width = cairo_image_surface_get_width (priv->bg_image);
+  height = cairo_image_surface_get_height (priv->bg_image);
 
   gtk_widget_set_size_request (GTK_WIDGET (window),
-                               cairo_image_surface_get_width (priv->bg_image),
-                               cairo_image_surface_get_height (priv->bg_image));
+                               width,
+                               height);
+
+  /* The icon cache is created first so its theme handler drops the old
+   * icons before the window looks its icon up again */
+  hd_icon_cache_get ();
+  g_signal_connect_swapped (gtk_icon_theme_get_default (), "changed",
+                            G_CALLBACK (hd_incoming_event_window_update_icon),
+                            window);
 }
 
 GtkWidget *
@@ -765,3 +766,39 @@ hd_incoming_event_window_new (gboolean     preview,
   return window;
 }
 
+
+/**
+ * hd_incoming_event_window_reset:
+ * @window: a #HDIncomingEventWindow
+ *
+ * Clears the contents of @window and stops its timeouts so it can be
+ * hidden and reused for another notification.
+ */
+void
+hd_incoming_event_window_reset (HDIncomingEventWindow *window)
+{
+  HDIncomingEventWindowPrivate *priv;
+
+  g_return_if_fail (HD_IS_INCOMING_EVENT_WINDOW (window));
+
+  priv = window->priv;
+
+  if (priv->timeout_id)
+    {
+      g_source_remove (priv->timeout_id);
+      priv->timeout_id = 0;
+    }
+
+  if (priv->time_watch)
+    priv->time_watch = (hd_time_difference_remove_watch (priv->time_watch), 0);
+
+  priv->time = -1;
+
+  g_object_set (window,
+                "destination", NULL,
+                "title", NULL,
+                "message", NULL,
+                "icon", NULL,
+                "amount", 1UL,
+                NULL);
+}
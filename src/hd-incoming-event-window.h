@@ -66,6 +66,8 @@ GtkWidget *hd_incoming_event_window_new      (gboolean     preview,
                                               time_t       time,
                                               const gchar *icon);
 
+void       hd_incoming_event_window_reset    (HDIncomingEventWindow *window);
+
 G_END_DECLS
 
 #endif
@@ -44,10 +44,12 @@
 #include <X11/X.h>
 #include <X11/Xatom.h>
 
+#include "hd-icon-cache.h"
 #include "hd-incoming-event-window.h"
 #include "hd-notification-manager.h"
 #include "hd-led-pattern.h"
 #include "hd-multi-map.h"
+#include "hd-time-difference.h"
 
 #include "hd-incoming-events.h"
 
@@ -69,6 +71,9 @@
 #define NOTIFICATION_GROUP_KEY_GROUP "Group"
 #define NOTIFICATION_GROUP_KEY_SPLIT_IN_THREADS "Split-In-Threads"
 
+/* Number of realized, hidden preview windows kept ready for reuse */
+#define PREVIEW_WINDOW_POOL_SIZE 2
+
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_NAME  "com.nokia.HildonSVNotificationDaemon" 
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_PATH  "/com/nokia/HildonSVNotificationDaemon"
 
@@ -135,6 +140,10 @@ struct _HDIncomingEventsPrivate
 
   GList           *preview_list;
   GtkWidget       *preview_window;
+  gint64           preview_request_time;
+
+  GList           *preview_pool;
+  guint            preview_pool_idle_id;
 
   GHashTable      *switcher_groups;
 
@@ -800,11 +809,22 @@ notifications_add_to_switcher (Notifications *ns)
     }
 }
 
+static void show_preview_window (HDIncomingEvents *ie);
+static void preview_window_release (HDIncomingEvents *ie,
+                                    GtkWidget        *window);
+
 static void
 preview_window_response (HDIncomingEventWindow *window,
                          gint                   response_id,
                          Notifications         *ns)
 {
+  HDIncomingEvents *ie = hd_incoming_events_get ();
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  /* The window is reused for other notifications, do not update it anymore */
+  ns->cb = NULL;
+  ns->cb_data = NULL;
+
   if (response_id == GTK_RESPONSE_OK)
     {
       notifications_activate (ns);
@@ -818,10 +838,11 @@ preview_window_response (HDIncomingEventWindow *window,
   else
     g_warning ("%s. Unexpected response id: %d", __FUNCTION__, response_id);
 
-  gtk_widget_destroy (GTK_WIDGET (window));
-}
+  preview_window_release (ie, GTK_WIDGET (window));
 
-static void show_preview_window (HDIncomingEvents *ie);
+  priv->preview_window = NULL;
+  show_preview_window (ie);
+}
 
 static void
 preview_window_destroy_cb (GtkWidget        *window,
@@ -834,6 +855,127 @@ preview_window_destroy_cb (GtkWidget        *window,
   show_preview_window (ie);
 }
 
+static gboolean
+preview_pool_refill_idle (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  GtkWidget *window;
+
+  if (g_list_length (priv->preview_pool) >= PREVIEW_WINDOW_POOL_SIZE)
+    {
+      priv->preview_pool_idle_id = 0;
+      return FALSE;
+    }
+
+  /* Construct and realize one window per idle call */
+  window = hd_incoming_event_window_new (TRUE,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         -1,
+                                         NULL);
+  gtk_widget_realize (window);
+
+  priv->preview_pool = g_list_prepend (priv->preview_pool,
+                                       window);
+
+  return TRUE;
+}
+
+static void
+preview_pool_schedule_refill (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  if (!priv->preview_pool_idle_id)
+    priv->preview_pool_idle_id = gdk_threads_add_idle_full (G_PRIORITY_LOW,
+                                                            (GSourceFunc) preview_pool_refill_idle,
+                                                            ie,
+                                                            NULL);
+}
+
+/*
+ * Returns a realized, hidden preview window from the pool, or a new one
+ * if the pool is empty.
+ */
+static GtkWidget *
+preview_window_take (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  GtkWidget *window;
+
+  if (priv->preview_pool)
+    {
+      window = priv->preview_pool->data;
+      priv->preview_pool = g_list_delete_link (priv->preview_pool,
+                                               priv->preview_pool);
+    }
+  else
+    {
+      g_debug ("%s. Preview window pool is empty", __FUNCTION__);
+      window = hd_incoming_event_window_new (TRUE,
+                                             NULL,
+                                             NULL,
+                                             NULL,
+                                             -1,
+                                             NULL);
+    }
+
+  preview_pool_schedule_refill (ie);
+
+  return window;
+}
+
+/*
+ * Hides and resets a preview window and puts it back into the pool.
+ */
+static void
+preview_window_release (HDIncomingEvents *ie,
+                        GtkWidget        *window)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  g_signal_handlers_disconnect_matched (window,
+                                        G_SIGNAL_MATCH_FUNC,
+                                        0, 0, NULL,
+                                        preview_window_response,
+                                        NULL);
+  g_signal_handlers_disconnect_by_func (window,
+                                        preview_window_destroy_cb,
+                                        ie);
+
+  gtk_widget_hide (window);
+  hd_incoming_event_window_reset (HD_INCOMING_EVENT_WINDOW (window));
+
+  if (g_list_length (priv->preview_pool) < PREVIEW_WINDOW_POOL_SIZE)
+    priv->preview_pool = g_list_prepend (priv->preview_pool,
+                                         window);
+  else
+    gtk_widget_destroy (window);
+}
+
+static gboolean
+preview_window_map_event (GtkWidget        *window,
+                          GdkEvent         *event,
+                          HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  if (priv->preview_request_time)
+    {
+      g_debug ("%s. Preview window mapped %" G_GINT64_FORMAT " us after request",
+               __FUNCTION__,
+               g_get_monotonic_time () - priv->preview_request_time);
+      priv->preview_request_time = 0;
+    }
+
+  g_signal_handlers_disconnect_by_func (window,
+                                        preview_window_map_event,
+                                        ie);
+
+  return FALSE;
+}
+
 static void
 show_preview_window (HDIncomingEvents *ie)
 {
@@ -863,13 +1005,10 @@ show_preview_window (HDIncomingEvents *ie)
   priv->preview_list = g_list_delete_link (priv->preview_list,
                                            priv->preview_list);
 
-  /* Create the notification preview window */
-  priv->preview_window = hd_incoming_event_window_new (TRUE,
-                                                       NULL,
-                                                       NULL,
-                                                       NULL,
-                                                       -1,
-                                                       NULL);
+  priv->preview_request_time = g_get_monotonic_time ();
+
+  /* Get a notification preview window */
+  priv->preview_window = preview_window_take (ie);
 
   ns->cb  = (NotificationsCallback) notifications_update_window;
   ns->cb_data = priv->preview_window;
@@ -879,6 +1018,8 @@ show_preview_window (HDIncomingEvents *ie)
                     ns);
   g_signal_connect (priv->preview_window, "destroy",
                     G_CALLBACK (preview_window_destroy_cb), ie);
+  g_signal_connect_after (priv->preview_window, "map-event",
+                          G_CALLBACK (preview_window_map_event), ie);
 
   notifications_update_window (ns,
                                priv->preview_window);
@@ -1008,27 +1149,39 @@ unperceived_notification_closed (HDNotification *notification,
                        G_OBJECT (notification));
 }
 
-static void
-hd_incoming_events_notified (HDNotificationManager  *nm,
-                             HDNotification         *notification,
-                             gboolean                replayed_event,
-                             HDIncomingEvents       *ie)
+static gboolean
+is_system_note (HDNotification *notification)
 {
-  HDIncomingEventsPrivate *priv = ie->priv;
   const gchar *category;
+
+  /* Get category string */
+  category = hd_notification_get_category (notification);
+
+  return category && g_str_has_prefix (category, "system.note.");
+}
+
+/*
+ * Adds @notification to the preview list or the switcher. The sound and
+ * vibra daemon is only called if @play_event is set.
+ *
+ * Returns: %TRUE if the display should be turned on without showing a
+ * notification window
+ */
+static gboolean
+hd_incoming_events_add_notification (HDIncomingEvents *ie,
+                                     HDNotification   *notification,
+                                     gboolean          replayed_event,
+                                     gboolean          play_event)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
 /*  guint i; */
   GValue *p;
   const gchar *pattern = NULL;
   Notifications *ns;
   CategoryInfo *info;
 
-  g_return_if_fail (HD_IS_INCOMING_EVENTS (ie));
-
-  /* Get category string */
-  category = hd_notification_get_category (notification);
-
   /* Do nothing for system.note.* notifications */
-  if (category && g_str_has_prefix (category, "system.note."))
+  if (is_system_note (notification))
     {
       /*
       for (i = 0; i < priv->plugins->len; i++)
@@ -1038,7 +1191,7 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
           hd_notification_plugin_notify (plugin, notification);
         }
       */
-      return;
+      return FALSE;
     }
 
   ns = notifications_new_for_notification (notification, NULL);
@@ -1049,11 +1202,11 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
     {
       notifications_add_to_switcher (ns);
 
-      return;
+      return FALSE;
     }
 
   /* Call sound/vibra daemon */
-  if (priv->sv_daemon_proxy)
+  if (play_event && priv->sv_daemon_proxy)
     {
       GHashTable *hints;
       const gchar *sender;
@@ -1107,24 +1260,13 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
 
   /* Return if no notification window should be shown */
   if (info && info->no_window)
-    return;
+    return FALSE;
 
   /* Check if no notification windows should be shown */
   p = hd_notification_get_hint (notification, "no-notification-window");
   if ((G_VALUE_HOLDS_BOOLEAN (p) && g_value_get_boolean (p)) ||
       (G_VALUE_HOLDS_UCHAR (p) && g_value_get_uchar (p)))
-    {
-      /* Send dbus request to mce to turn display backlight on */
-      if (priv->mce_proxy)
-        {
-          g_debug ("%s. Call %s",
-                   __FUNCTION__,
-                   MCE_DISPLAY_ON_REQ);
-          dbus_g_proxy_call_no_reply (priv->mce_proxy, MCE_DISPLAY_ON_REQ,
-                                      G_TYPE_INVALID, G_TYPE_INVALID);
-        }
-      return;      
-    }
+    return TRUE;
 
   if (info)
     {
@@ -1154,6 +1296,58 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
                                           ns);
     }
 
+  return FALSE;
+}
+
+static void
+hd_incoming_events_notified_batch (HDNotificationManager *nm,
+                                   GPtrArray             *notifications,
+                                   gboolean               replayed_events,
+                                   HDIncomingEvents      *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  HDNotification *play_notification = NULL;
+  gboolean display_on_request = FALSE;
+  guint i;
+
+  g_return_if_fail (HD_IS_INCOMING_EVENTS (ie));
+
+  /* Play sound and vibra only once per batch, for the latest notification */
+  if (!replayed_events)
+    {
+      for (i = notifications->len; i > 0; i--)
+        {
+          HDNotification *n = g_ptr_array_index (notifications, i - 1);
+
+          if (!is_system_note (n))
+            {
+              play_notification = n;
+              break;
+            }
+        }
+    }
+
+  for (i = 0; i < notifications->len; i++)
+    {
+      HDNotification *n = g_ptr_array_index (notifications, i);
+
+      if (hd_incoming_events_add_notification (ie,
+                                               n,
+                                               replayed_events,
+                                               n == play_notification))
+        display_on_request = TRUE;
+    }
+
+  /* Send dbus request to mce to turn display backlight on */
+  if (display_on_request && priv->mce_proxy)
+    {
+      g_debug ("%s. Call %s",
+               __FUNCTION__,
+               MCE_DISPLAY_ON_REQ);
+      dbus_g_proxy_call_no_reply (priv->mce_proxy, MCE_DISPLAY_ON_REQ,
+                                  G_TYPE_INVALID, G_TYPE_INVALID);
+    }
+
   show_preview_window (ie);
 }
 
@@ -1174,6 +1368,15 @@ hd_incoming_events_dispose (GObject *object)
   if (priv->unperceived_notifications)
     priv->unperceived_notifications = (g_object_unref (priv->unperceived_notifications), NULL);
 
+  if (priv->preview_pool_idle_id)
+    priv->preview_pool_idle_id = (g_source_remove (priv->preview_pool_idle_id), 0);
+
+  if (priv->preview_pool)
+    {
+      g_list_foreach (priv->preview_pool, (GFunc) gtk_widget_destroy, NULL);
+      priv->preview_pool = (g_list_free (priv->preview_pool), NULL);
+    }
+
   G_OBJECT_CLASS (hd_incoming_events_parent_class)->dispose (object);
 }
 
@@ -1428,6 +1631,31 @@ hd_incoming_events_plugin_removed (HDPluginManager  *pm,
     g_warning ("Plugin from type %s is no HDNotificationPlugin", G_OBJECT_TYPE_NAME (plugin));
 }
 
+/*
+ * Preload the icons of all categories, so the first notification
+ * of a category does not have to wait for the icon decoding.
+ */
+static gboolean
+preload_category_icons_idle (gpointer data)
+{
+  HDIncomingEvents *ie = data;
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, ie->priv->categories);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      CategoryInfo *info = value;
+
+      if (info->icon)
+        hd_icon_cache_preload (hd_icon_cache_get (),
+                               info->icon,
+                               HILDON_ICON_PIXEL_SIZE_STYLUS);
+    }
+
+  return FALSE;
+}
+
 static gboolean
 load_plugins_idle (gpointer data)
 {
@@ -1498,6 +1726,9 @@ hd_incoming_events_system_bus_signal_handler (DBusConnection *conn,
 
           priv->display_on = display_on;
 
+          /* Relative time labels are not visible with display off */
+          hd_time_difference_set_active (display_on);
+
           if (display_on && priv->task_switcher_shown)
             {
               hd_led_pattern_deactivate_all ();
@@ -1661,11 +1892,20 @@ hd_incoming_events_init (HDIncomingEvents *ie)
   /* Load notification plugins when idle */
   gdk_threads_add_idle (load_plugins_idle, priv->plugin_manager);
 
+  /* Prepare preview windows when idle */
+  preview_pool_schedule_refill (ie);
+
   /* Connect to notification manager signals */
-  g_signal_connect_object (hd_notification_manager_get (), "notified",
-                           G_CALLBACK (hd_incoming_events_notified), ie, 0);
+  g_signal_connect_object (hd_notification_manager_get (), "notified-batch",
+                           G_CALLBACK (hd_incoming_events_notified_batch), ie, 0);
   load_category_infos (ie);
 
+  /* Preload category icons when idle */
+  gdk_threads_add_idle_full (G_PRIORITY_LOW,
+                             preload_category_icons_idle,
+                             ie,
+                             NULL);
+
   /* Get D-Bus proxy for mce calls */
   connection = dbus_g_bus_get (DBUS_BUS_SYSTEM, &error);
 
@@ -71,6 +71,7 @@ G_DEFINE_TYPE (HDNotificationManager, hd_notification_manager, G_TYPE_OBJECT);
 
 enum {
     NOTIFIED,
+    NOTIFIED_BATCH,
     N_SIGNALS
 };
 
@@ -109,6 +110,15 @@ struct _HDNotificationManagerPrivate
   time_t           commit_timeout;
   gulong           commit_callback;
 
+  /*
+   * New notifications are queued in @pending_notified and emitted
+   * together from one idle source @emit_idle_id.
+   * @loaded_notifications collects the notifications read in
+   * hd_notification_manager_db_load().
+   */
+  GPtrArray       *pending_notified;
+  guint            emit_idle_id;
+  GPtrArray       *loaded_notifications;
 };
 
 /* IPC structure between _insert_hints() and _insert_hint(). */
@@ -334,18 +344,48 @@ hd_notification_manager_load_row (void *data,
                        GUINT_TO_POINTER (id),
                        notification);
 
-  g_signal_emit (nm, signals[NOTIFIED], 0, notification, TRUE);
+  g_ptr_array_add (nm->priv->loaded_notifications,
+                   g_object_ref (notification));
 
   return 0;
 }
 
+/*
+ * Emits ::notified for each notification in @notifications followed by
+ * one ::notified-batch for all of them.
+ */
+static void
+hd_notification_manager_emit_notified (HDNotificationManager *nm,
+                                       GPtrArray             *notifications,
+                                       gboolean               replayed_events)
+{
+  guint i;
+
+  if (!notifications->len)
+    return;
+
+  for (i = 0; i < notifications->len; i++)
+    g_signal_emit (nm, signals[NOTIFIED], 0,
+                   g_ptr_array_index (notifications, i),
+                   replayed_events);
+
+  g_signal_emit (nm, signals[NOTIFIED_BATCH], 0,
+                 notifications,
+                 replayed_events);
+}
+
 void 
 hd_notification_manager_db_load (HDNotificationManager *nm)
 {
   gchar *error = NULL;
 
+  GPtrArray *loaded;
+
   g_return_if_fail (nm->priv->db != NULL);
 
+  loaded = g_ptr_array_new_with_free_func (g_object_unref);
+  nm->priv->loaded_notifications = loaded;
+
   if (sqlite3_exec (nm->priv->db, 
                     "SELECT * FROM notifications",
                     hd_notification_manager_load_row,
@@ -355,6 +395,12 @@ hd_notification_manager_db_load (HDNotificationManager *nm)
       g_warning ("Unable to load notifications: %s", error);
       sqlite3_free (error);
     }
+
+  nm->priv->loaded_notifications = NULL;
+
+  hd_notification_manager_emit_notified (nm, loaded, TRUE);
+
+  g_ptr_array_free (loaded, TRUE);
 }
 
 static gint 
@@ -1031,6 +1077,12 @@ hd_notification_manager_dispose (GObject *object)
   if (priv->connection)
     priv->connection = (dbus_g_connection_unref (priv->connection), NULL);
 
+  if (priv->emit_idle_id)
+    priv->emit_idle_id = (g_source_remove (priv->emit_idle_id), 0);
+
+  if (priv->pending_notified)
+    priv->pending_notified = (g_ptr_array_free (priv->pending_notified, TRUE), NULL);
+
   G_OBJECT_CLASS (hd_notification_manager_parent_class)->dispose (object);
 }
 
@@ -1081,6 +1133,19 @@ hd_notification_manager_class_init (HDNotificationManagerClass *class)
                   G_TYPE_NONE, 2,
                   HD_TYPE_NOTIFICATION, G_TYPE_BOOLEAN);
 
+  /* Emitted once per batch of new notifications after ::notified was
+   * emitted for each of them. The GPtrArray of HDNotifications is only
+   * valid during the emission. */
+  signals[NOTIFIED_BATCH] =
+    g_signal_new ("notified-batch",
+                  G_OBJECT_CLASS_TYPE (g_object_class),
+                  G_SIGNAL_RUN_FIRST,
+                  G_STRUCT_OFFSET (HDNotificationManagerClass, notified_batch),
+                  NULL, NULL,
+                  hd_cclosure_marshal_VOID__POINTER_BOOLEAN,
+                  G_TYPE_NONE, 2,
+                  G_TYPE_POINTER, G_TYPE_BOOLEAN);
+
   g_type_class_add_private (class, sizeof (HDNotificationManagerPrivate));
 }
 
@@ -1186,16 +1251,41 @@ copy_hash_table_item (gchar *key, GValue *value, GHashTable *new_hash_table)
 static gboolean
 idle_emit (gpointer data)
 {
-  HDNotificationManager *nm = hd_notification_manager_get ();
+  HDNotificationManager *nm = data;
+  HDNotificationManagerPrivate *priv = nm->priv;
+  GPtrArray *notifications;
 
-  if (nm)
-    g_signal_emit (nm, signals[NOTIFIED], 0, data, FALSE);
+  priv->emit_idle_id = 0;
 
-  g_object_unref (data);
+  /* Notifications arriving during the emission start a new batch */
+  notifications = priv->pending_notified;
+  priv->pending_notified = NULL;
+
+  if (notifications)
+    {
+      hd_notification_manager_emit_notified (nm, notifications, FALSE);
+      g_ptr_array_free (notifications, TRUE);
+    }
 
   return FALSE;
 }
 
+static void
+hd_notification_manager_queue_notified (HDNotificationManager *nm,
+                                        HDNotification        *notification)
+{
+  HDNotificationManagerPrivate *priv = nm->priv;
+
+  if (!priv->pending_notified)
+    priv->pending_notified = g_ptr_array_new_with_free_func (g_object_unref);
+
+  g_ptr_array_add (priv->pending_notified,
+                   g_object_ref (notification));
+
+  if (!priv->emit_idle_id)
+    priv->emit_idle_id = gdk_threads_add_idle (idle_emit, nm);
+}
+
 gboolean
 hd_notification_manager_notify (HDNotificationManager *nm,
                                 const gchar           *app_name,
@@ -1312,7 +1402,7 @@ hd_notification_manager_notify (HDNotificationManager *nm,
                            GUINT_TO_POINTER (id),
                            notification);
 
-      gdk_threads_add_idle (idle_emit, g_object_ref (notification));
+      hd_notification_manager_queue_notified (nm, notification);
 
       if (persistent && nm->priv->db)
         {
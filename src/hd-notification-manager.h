@@ -60,8 +60,11 @@ struct _HDNotificationManagerClass
 {
   GObjectClass parent_class;
 
-  void (*notified)    (HDNotificationManager *nm,
-                       HDNotification        *notification);
+  void (*notified)       (HDNotificationManager *nm,
+                          HDNotification        *notification);
+  void (*notified_batch) (HDNotificationManager *nm,
+                          GPtrArray             *notifications,
+                          gboolean               replayed_events);
 };
 
 GType                  hd_notification_manager_get_type              (void);
@@ -33,6 +33,22 @@ typedef struct
   int height;
 } HDImageSize;
 
+/* PNG row filters used by hd_pixbuf_utils_save_png () */
+typedef enum
+{
+  HD_PNG_FILTER_NONE,
+  HD_PNG_FILTER_SUB,
+  HD_PNG_FILTER_UP,
+  HD_PNG_FILTER_AVERAGE,
+  HD_PNG_FILTER_PAETH,
+  HD_PNG_FILTER_ADAPTIVE
+} HDPngFilter;
+
+/* Cached images are rewritten often, favour encode speed over size. See
+ * the png-compression benchmark in hd-pixbuf-utils.c (-m perf). */
+#define HD_PNG_COMPRESSION_DEFAULT 1
+#define HD_PNG_FILTER_DEFAULT      HD_PNG_FILTER_SUB
+
 GdkPixbuf *hd_pixbuf_utils_load_at_size (GFile         *file,
                                          HDImageSize   *size,
                                          char         **etag,
@@ -45,11 +61,24 @@ GdkPixbuf *hd_pixbuf_utils_load_scaled_and_cropped  (GFile         *file,
                                                      GCancellable  *cancellable,
                                                      GError       **error);
 
+GdkPixbuf *hd_pixbuf_utils_load_preview             (GFile         *file,
+                                                     HDImageSize   *size,
+                                                     GCancellable  *cancellable,
+                                                     GError       **error);
+
 gboolean   hd_pixbuf_utils_save                     (GFile         *file,
                                                      GdkPixbuf     *pixbuf,
                                                      const gchar   *type,
                                                      GCancellable  *cancellable,
                                                      GError       **error);
+gboolean   hd_pixbuf_utils_save_png                 (GFile         *file,
+                                                     GdkPixbuf     *pixbuf,
+                                                     gint           compression_level,
+                                                     HDPngFilter    filter,
+                                                     GCancellable  *cancellable,
+                                                     GError       **error);
+
+GdkPixbuf *hd_pixbuf_utils_new_from_surface         (cairo_surface_t *surface);
 G_END_DECLS
 
 #endif
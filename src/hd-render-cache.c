@@ -0,0 +1,608 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hd-render-cache.h"
+
+/*
+ * Rendered images are stored content addressed, the file name is a hash of
+ * the source URI, the etag of the source, the orientation of the view and
+ * the size of the rendered image.
+ * The files are hard linked into their destination, so an entry only costs
+ * disk space while it is not the cached image of any view.
+ */
+
+#define ENTRY_SUFFIX ".png"
+#define TMP_PREFIX   ".tmp-"
+
+#define HD_RENDER_CACHE_GET_PRIVATE(object) \
+  (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_RENDER_CACHE, HDRenderCachePrivate))
+
+typedef struct
+{
+  gchar   *name;
+  goffset  size;
+  time_t   mtime;
+  GList   *lru_link;
+} CacheEntry;
+
+struct _HDRenderCachePrivate
+{
+  gchar      *path;
+
+  /* Lookups and inserts are done by the worker threads */
+  GMutex      mutex;
+
+  /* Read lazily from the cache directory */
+  gboolean    scanned;
+
+  /* name -> CacheEntry */
+  GHashTable *table;
+
+  /* CacheEntries, most recently used first */
+  GQueue      lru;
+
+  goffset     size;
+  goffset     max_size;
+};
+
+static void hd_render_cache_finalize (GObject *object);
+
+G_DEFINE_TYPE (HDRenderCache, hd_render_cache, G_TYPE_OBJECT);
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_free (entry->name);
+  g_slice_free (CacheEntry, entry);
+}
+
+static gchar *
+get_entry_name (const gchar       *uri,
+                const gchar       *etag,
+                const HDImageSize *size,
+                gboolean           portrait)
+{
+  gchar *key, *checksum, *name;
+
+  key = g_strdup_printf ("%s\n%s\n%s\n%dx%d",
+                         uri,
+                         etag,
+                         portrait ? "portrait" : "landscape",
+                         size->width,
+                         size->height);
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+  name = g_strconcat (checksum, ENTRY_SUFFIX, NULL);
+
+  g_free (checksum);
+  g_free (key);
+
+  return name;
+}
+
+static void
+cache_add_entry (HDRenderCache *cache,
+                 gchar         *name,
+                 goffset        size,
+                 time_t         mtime)
+{
+  HDRenderCachePrivate *priv = cache->priv;
+  CacheEntry *entry = g_slice_new0 (CacheEntry);
+
+  entry->name = name;
+  entry->size = size;
+  entry->mtime = mtime;
+
+  g_queue_push_head (&priv->lru, entry);
+  entry->lru_link = priv->lru.head;
+  priv->size += entry->size;
+
+  g_hash_table_insert (priv->table,
+                       entry->name,
+                       entry);
+}
+
+static void
+cache_remove_entry (HDRenderCache *cache,
+                    CacheEntry    *entry,
+                    gboolean       unlink_file)
+{
+  HDRenderCachePrivate *priv = cache->priv;
+
+  if (unlink_file)
+    {
+      gchar *path = g_build_filename (priv->path, entry->name, NULL);
+
+      if (g_unlink (path) != 0 && errno != ENOENT)
+        g_debug ("%s. Could not remove %s. %s",
+                 __FUNCTION__,
+                 path,
+                 g_strerror (errno));
+
+      g_free (path);
+    }
+
+  priv->size -= entry->size;
+  g_queue_delete_link (&priv->lru, entry->lru_link);
+
+  /* Frees the entry */
+  g_hash_table_remove (priv->table, entry->name);
+}
+
+/*
+ * Evict least recently used images until the cache fits into its budget.
+ */
+static void
+cache_evict (HDRenderCache *cache)
+{
+  HDRenderCachePrivate *priv = cache->priv;
+
+  while (priv->lru.tail && priv->size > priv->max_size)
+    {
+      CacheEntry *entry = priv->lru.tail->data;
+
+      g_debug ("%s. Evict %s (%" G_GOFFSET_FORMAT " bytes)",
+               __FUNCTION__,
+               entry->name,
+               entry->size);
+
+      cache_remove_entry (cache, entry, TRUE);
+    }
+}
+
+static gint
+compare_entries_by_mtime (gconstpointer a,
+                          gconstpointer b)
+{
+  const CacheEntry *entry_a = a, *entry_b = b;
+
+  if (entry_a->mtime < entry_b->mtime)
+    return -1;
+
+  return entry_a->mtime > entry_b->mtime;
+}
+
+/*
+ * Reads the entries left by previous runs, the modification time of an
+ * entry is updated on each hit so it orders the LRU list.
+ */
+static void
+cache_scan (HDRenderCache *cache)
+{
+  HDRenderCachePrivate *priv = cache->priv;
+  GDir *dir;
+  const gchar *name;
+  GList *entries = NULL, *l;
+  GError *error = NULL;
+
+  priv->scanned = TRUE;
+
+  if (g_mkdir_with_parents (priv->path, 0755) != 0)
+    {
+      g_warning ("%s. Could not create %s. %s",
+                 __FUNCTION__,
+                 priv->path,
+                 g_strerror (errno));
+      return;
+    }
+
+  dir = g_dir_open (priv->path, 0, &error);
+  if (error)
+    {
+      g_warning ("%s. Could not open %s. %s",
+                 __FUNCTION__,
+                 priv->path,
+                 error->message);
+      g_error_free (error);
+      return;
+    }
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      gchar *path = g_build_filename (priv->path, name, NULL);
+      struct stat st;
+
+      /* Left behind by an interrupted insert */
+      if (g_str_has_prefix (name, TMP_PREFIX))
+        g_unlink (path);
+      else if (g_str_has_suffix (name, ENTRY_SUFFIX) &&
+               g_stat (path, &st) == 0 &&
+               S_ISREG (st.st_mode))
+        {
+          CacheEntry *entry = g_slice_new0 (CacheEntry);
+
+          entry->name = g_strdup (name);
+          entry->size = st.st_size;
+          entry->mtime = st.st_mtime;
+
+          entries = g_list_prepend (entries, entry);
+        }
+
+      g_free (path);
+    }
+
+  g_dir_close (dir);
+
+  /* Oldest first, so the most recently used ends up at the head */
+  entries = g_list_sort (entries, compare_entries_by_mtime);
+  for (l = entries; l; l = l->next)
+    {
+      CacheEntry *entry = l->data;
+
+      cache_add_entry (cache, entry->name, entry->size, entry->mtime);
+
+      entry->name = NULL;
+      cache_entry_free (entry);
+    }
+  g_list_free (entries);
+
+  cache_evict (cache);
+}
+
+/*
+ * Hard links @src_path to @dest_path, or copies it if it cannot be linked.
+ * @dest_path is replaced atomically.
+ */
+static gboolean
+link_or_copy (const gchar *src_path,
+              const gchar *dest_path,
+              const gchar *tmp_path)
+{
+  gboolean done = FALSE;
+
+  g_unlink (tmp_path);
+
+  if (link (src_path, tmp_path) == 0)
+    done = TRUE;
+  else
+    {
+      GFile *src = g_file_new_for_path (src_path);
+      GFile *tmp = g_file_new_for_path (tmp_path);
+      GError *error = NULL;
+
+      g_debug ("%s. Could not link %s, copy it. %s",
+               __FUNCTION__,
+               src_path,
+               g_strerror (errno));
+
+      done = g_file_copy (src,
+                          tmp,
+                          G_FILE_COPY_OVERWRITE,
+                          NULL,
+                          NULL,
+                          NULL,
+                          &error);
+      if (error)
+        {
+          g_debug ("%s. Could not copy %s. %s",
+                   __FUNCTION__,
+                   src_path,
+                   error->message);
+          g_error_free (error);
+        }
+
+      g_object_unref (src);
+      g_object_unref (tmp);
+    }
+
+  if (done && g_rename (tmp_path, dest_path) != 0)
+    {
+      g_debug ("%s. Could not rename %s. %s",
+               __FUNCTION__,
+               tmp_path,
+               g_strerror (errno));
+      done = FALSE;
+    }
+
+  if (!done)
+    g_unlink (tmp_path);
+
+  return done;
+}
+
+HDRenderCache *
+hd_render_cache_new (const gchar *path,
+                     goffset      max_size)
+{
+  HDRenderCache *cache;
+
+  cache = g_object_new (HD_TYPE_RENDER_CACHE,
+                        NULL);
+
+  cache->priv->path = g_strdup (path);
+  cache->priv->max_size = max_size;
+
+  return cache;
+}
+
+static void
+hd_render_cache_class_init (HDRenderCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = hd_render_cache_finalize;
+
+  g_type_class_add_private (klass, sizeof (HDRenderCachePrivate));
+}
+
+static void
+hd_render_cache_init (HDRenderCache *cache)
+{
+  HDRenderCachePrivate *priv;
+
+  priv = cache->priv = HD_RENDER_CACHE_GET_PRIVATE (cache);
+
+  g_mutex_init (&priv->mutex);
+  priv->table = g_hash_table_new_full (g_str_hash,
+                                       g_str_equal,
+                                       NULL,
+                                       (GDestroyNotify) cache_entry_free);
+  g_queue_init (&priv->lru);
+}
+
+static void
+hd_render_cache_finalize (GObject *object)
+{
+  HDRenderCachePrivate *priv = HD_RENDER_CACHE (object)->priv;
+
+  g_queue_clear (&priv->lru);
+  priv->table = (g_hash_table_destroy (priv->table), NULL);
+  priv->path = (g_free (priv->path), NULL);
+  g_mutex_clear (&priv->mutex);
+
+  G_OBJECT_CLASS (hd_render_cache_parent_class)->finalize (object);
+}
+
+/**
+ * hd_render_cache_lookup:
+ * @cache: a #HDRenderCache
+ * @uri: the URI of the source image
+ * @etag: the current etag of the source image
+ * @size: the size of the rendered image
+ * @portrait: whether the image was rendered for a portrait view
+ * @dest_filename: where to put the rendered image
+ *
+ * Links or copies the image rendered from @uri at @size to @dest_filename
+ * if it is in the cache. Can be called from any thread.
+ *
+ * Returns: %TRUE if @dest_filename was replaced by the cached image
+ */
+gboolean
+hd_render_cache_lookup (HDRenderCache     *cache,
+                        const gchar       *uri,
+                        const gchar       *etag,
+                        const HDImageSize *size,
+                        gboolean           portrait,
+                        const gchar       *dest_filename)
+{
+  HDRenderCachePrivate *priv;
+  CacheEntry *entry;
+  gchar *name, *path, *tmp_path;
+  gboolean found = FALSE;
+
+  g_return_val_if_fail (HD_IS_RENDER_CACHE (cache), FALSE);
+
+  if (!uri || !etag)
+    return FALSE;
+
+  priv = cache->priv;
+
+  name = get_entry_name (uri, etag, size, portrait);
+
+  g_mutex_lock (&priv->mutex);
+
+  if (!priv->scanned)
+    cache_scan (cache);
+
+  entry = g_hash_table_lookup (priv->table, name);
+  if (entry)
+    {
+      path = g_build_filename (priv->path, entry->name, NULL);
+      tmp_path = g_strconcat (dest_filename, ".render-cache", NULL);
+
+      /* Linked with the lock held, so the entry is not evicted meanwhile */
+      found = link_or_copy (path, dest_filename, tmp_path);
+
+      if (found)
+        {
+          g_utime (path, NULL);
+
+          g_queue_unlink (&priv->lru, entry->lru_link);
+          g_queue_push_head_link (&priv->lru, entry->lru_link);
+        }
+      else
+        cache_remove_entry (cache, entry, FALSE);
+
+      g_free (tmp_path);
+      g_free (path);
+    }
+
+  g_mutex_unlock (&priv->mutex);
+
+  g_debug ("%s. %s %s (%dx%d)",
+           __FUNCTION__,
+           found ? "Hit" : "Miss",
+           uri,
+           size->width,
+           size->height);
+
+  g_free (name);
+
+  return found;
+}
+
+/**
+ * hd_render_cache_contains:
+ * @cache: a #HDRenderCache
+ * @uri: the URI of the source image
+ * @etag: the current etag of the source image
+ * @size: the size of the rendered image
+ * @portrait: whether the image was rendered for a portrait view
+ *
+ * Checks whether the image rendered from @uri at @size is in the cache,
+ * without marking it as used. Can be called from any thread.
+ *
+ * Returns: %TRUE if hd_render_cache_lookup() would find the image
+ */
+gboolean
+hd_render_cache_contains (HDRenderCache     *cache,
+                          const gchar       *uri,
+                          const gchar       *etag,
+                          const HDImageSize *size,
+                          gboolean           portrait)
+{
+  HDRenderCachePrivate *priv;
+  gchar *name;
+  gboolean found;
+
+  g_return_val_if_fail (HD_IS_RENDER_CACHE (cache), FALSE);
+
+  if (!uri || !etag)
+    return FALSE;
+
+  priv = cache->priv;
+
+  name = get_entry_name (uri, etag, size, portrait);
+
+  g_mutex_lock (&priv->mutex);
+
+  if (!priv->scanned)
+    cache_scan (cache);
+
+  found = g_hash_table_lookup (priv->table, name) != NULL;
+
+  g_mutex_unlock (&priv->mutex);
+
+  g_free (name);
+
+  return found;
+}
+
+/**
+ * hd_render_cache_insert:
+ * @cache: a #HDRenderCache
+ * @uri: the URI of the source image
+ * @etag: the etag the source image had when it was rendered
+ * @size: the size of the rendered image
+ * @portrait: whether the image was rendered for a portrait view
+ * @filename: the rendered image
+ *
+ * Adds the image at @filename to the cache and evicts the least recently
+ * used images if the cache exceeds its budget. Can be called from any
+ * thread.
+ */
+void
+hd_render_cache_insert (HDRenderCache     *cache,
+                        const gchar       *uri,
+                        const gchar       *etag,
+                        const HDImageSize *size,
+                        gboolean           portrait,
+                        const gchar       *filename)
+{
+  HDRenderCachePrivate *priv;
+  CacheEntry *entry;
+  gchar *name, *path, *tmp_path;
+  struct stat st;
+
+  g_return_if_fail (HD_IS_RENDER_CACHE (cache));
+
+  if (!uri || !etag)
+    return;
+
+  priv = cache->priv;
+
+  name = get_entry_name (uri, etag, size, portrait);
+
+  g_mutex_lock (&priv->mutex);
+
+  if (!priv->scanned)
+    cache_scan (cache);
+
+  path = g_build_filename (priv->path, name, NULL);
+
+  entry = g_hash_table_lookup (priv->table, name);
+  if (entry)
+    {
+      /* Already cached, e.g. linked for another view */
+      g_utime (path, NULL);
+
+      g_queue_unlink (&priv->lru, entry->lru_link);
+      g_queue_push_head_link (&priv->lru, entry->lru_link);
+
+      g_free (name);
+    }
+  else
+    {
+      tmp_path = g_strconcat (priv->path,
+                              G_DIR_SEPARATOR_S TMP_PREFIX,
+                              name,
+                              NULL);
+
+      if (link_or_copy (filename, path, tmp_path) &&
+          g_stat (path, &st) == 0)
+        {
+          cache_add_entry (cache, name, st.st_size, st.st_mtime);
+          cache_evict (cache);
+        }
+      else
+        g_free (name);
+
+      g_free (tmp_path);
+    }
+
+  g_mutex_unlock (&priv->mutex);
+
+  g_free (path);
+}
+
+/**
+ * hd_render_cache_set_max_size:
+ * @cache: a #HDRenderCache
+ * @max_size: the budget in bytes
+ *
+ * Sets the amount of disk space the cached images may use. Least recently
+ * used images are evicted when the budget is exceeded.
+ */
+void
+hd_render_cache_set_max_size (HDRenderCache *cache,
+                              goffset        max_size)
+{
+  g_return_if_fail (HD_IS_RENDER_CACHE (cache));
+
+  g_mutex_lock (&cache->priv->mutex);
+
+  cache->priv->max_size = max_size;
+
+  if (cache->priv->scanned)
+    cache_evict (cache);
+
+  g_mutex_unlock (&cache->priv->mutex);
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_RENDER_CACHE_H__
+#define __HD_RENDER_CACHE_H__
+
+#include <gio/gio.h>
+
+#include "hd-pixbuf-utils.h"
+
+G_BEGIN_DECLS
+
+#define HD_TYPE_RENDER_CACHE            (hd_render_cache_get_type ())
+#define HD_RENDER_CACHE(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), HD_TYPE_RENDER_CACHE, HDRenderCache))
+#define HD_RENDER_CACHE_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), HD_TYPE_RENDER_CACHE, HDRenderCacheClass))
+#define HD_IS_RENDER_CACHE(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), HD_TYPE_RENDER_CACHE))
+#define HD_IS_RENDER_CACHE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), HD_TYPE_RENDER_CACHE))
+#define HD_RENDER_CACHE_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), HD_TYPE_RENDER_CACHE, HDRenderCacheClass))
+
+typedef struct _HDRenderCache        HDRenderCache;
+typedef struct _HDRenderCacheClass   HDRenderCacheClass;
+typedef struct _HDRenderCachePrivate HDRenderCachePrivate;
+
+struct _HDRenderCache
+{
+  GObject parent;
+
+  HDRenderCachePrivate *priv;
+};
+
+struct _HDRenderCacheClass
+{
+  GObjectClass parent;
+};
+
+GType          hd_render_cache_get_type     (void);
+
+HDRenderCache *hd_render_cache_new          (const gchar       *path,
+                                             goffset            max_size);
+
+gboolean       hd_render_cache_lookup       (HDRenderCache     *cache,
+                                             const gchar       *uri,
+                                             const gchar       *etag,
+                                             const HDImageSize *size,
+                                             gboolean           portrait,
+                                             const gchar       *dest_filename);
+gboolean       hd_render_cache_contains     (HDRenderCache     *cache,
+                                             const gchar       *uri,
+                                             const gchar       *etag,
+                                             const HDImageSize *size,
+                                             gboolean           portrait);
+void           hd_render_cache_insert       (HDRenderCache     *cache,
+                                             const gchar       *uri,
+                                             const gchar       *etag,
+                                             const HDImageSize *size,
+                                             gboolean           portrait,
+                                             const gchar       *filename);
+
+void           hd_render_cache_set_max_size (HDRenderCache     *cache,
+                                             goffset            max_size);
+
+G_END_DECLS
+
+#endif
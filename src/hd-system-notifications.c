@@ -235,6 +235,21 @@ system_notifications_notified (HDNotificationManager *nm,
     return;
 }
 
+static void
+system_notifications_notified_batch (HDNotificationManager *nm,
+                                     GPtrArray             *notifications,
+                                     gboolean               replayed_events,
+                                     HDSystemNotifications *sn)
+{
+  guint i;
+
+  for (i = 0; i < notifications->len; i++)
+    system_notifications_notified (nm,
+                                   g_ptr_array_index (notifications, i),
+                                   replayed_events,
+                                   sn);
+}
+
 static void
 destroy_dialog (GtkWidget *dialog, HDSystemNotifications *sn)
 {
@@ -280,8 +295,8 @@ hd_system_notifications_get ()
   HDSystemNotifications *sn = g_object_new (HD_TYPE_SYSTEM_NOTIFICATIONS, NULL);
 
   sn->priv->nm = hd_notification_manager_get ();
-  g_signal_connect (sn->priv->nm, "notified",
-                    G_CALLBACK (system_notifications_notified), sn);
+  g_signal_connect (sn->priv->nm, "notified-batch",
+                    G_CALLBACK (system_notifications_notified_batch), sn);
 
   return sn;
 }
@@ -50,6 +50,27 @@ const static TimeDiffInfo entries[] = {
   { YEAR, -1, "wdgt_va_ago_one_year", "wdgt_va_ago_years" }
 };
 
+/*
+ * A registered relative time label. All watches share one ticker source
+ * which is scheduled for the earliest unit boundary of any watch.
+ */
+typedef struct
+{
+  guint                id;
+  time_t               time;
+  time_t               next_update;
+  HDTimeDifferenceFunc func;
+  gpointer             data;
+} TimeDiffWatch;
+
+static GList *watches = NULL;
+static guint next_watch_id = 1;
+static guint ticker_source = 0;
+static gboolean ticker_active = TRUE;
+
+/* (unit, count) -> localized text */
+static GHashTable *text_cache = NULL;
+
 static inline gchar *
 get_time_diff_text_for_info (const TimeDiffInfo *info,
                              time_t              difference)
@@ -63,6 +84,30 @@ get_time_diff_text_for_info (const TimeDiffInfo *info,
                           diff_in_unit);
 }
 
+static const gchar *
+get_cached_time_diff_text_for_info (const TimeDiffInfo *info,
+                                    time_t              difference)
+{
+  time_t diff_in_unit = (difference + (info->unit / 2)) / info->unit;
+  gpointer key;
+  gchar *text;
+
+  if (G_UNLIKELY (!text_cache))
+    text_cache = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                        NULL, g_free);
+
+  key = GSIZE_TO_POINTER (diff_in_unit * G_N_ELEMENTS (entries) + (info - entries));
+
+  text = g_hash_table_lookup (text_cache, key);
+  if (!text)
+    {
+      text = get_time_diff_text_for_info (info, difference);
+      g_hash_table_insert (text_cache, key, text);
+    }
+
+  return text;
+}
+
 static inline gboolean
 should_time_displayed (time_t difference)
 {
@@ -98,8 +143,8 @@ hd_time_difference_get_text (time_t difference)
   info = get_time_diff_info_for_difference (difference);
 
   if (info)
-    return get_time_diff_text_for_info (info,
-                                        difference);
+    return g_strdup (get_cached_time_diff_text_for_info (info,
+                                                         difference));
   else
     return NULL;
 }
@@ -131,6 +176,189 @@ hd_time_difference_get_timeout (time_t difference)
     return (MINUTE / 2) - difference;
 }
 
+static void
+watch_update (TimeDiffWatch *watch,
+              time_t         now)
+{
+  const TimeDiffInfo *info;
+  const gchar *text = NULL;
+  time_t difference = now - watch->time;
+
+  info = get_time_diff_info_for_difference (difference);
+  if (info)
+    text = get_cached_time_diff_text_for_info (info,
+                                               difference);
+
+  watch->next_update = now + hd_time_difference_get_timeout (difference);
+
+  watch->func (text, watch->data);
+}
+
+/*
+ * Update all watches which reached their next unit boundary (or all
+ * watches if @force is set). Callbacks may add or remove watches, so
+ * work on a snapshot and skip watches removed in between.
+ */
+static void
+update_watches (gboolean force)
+{
+  GList *due = NULL, *l;
+  time_t now;
+
+  time (&now);
+
+  for (l = watches; l; l = l->next)
+    {
+      TimeDiffWatch *watch = l->data;
+
+      if (force || watch->next_update <= now)
+        due = g_list_prepend (due, GUINT_TO_POINTER (watch->id));
+    }
+
+  for (l = due; l; l = l->next)
+    {
+      GList *w;
+
+      for (w = watches; w; w = w->next)
+        {
+          TimeDiffWatch *watch = w->data;
+
+          if (watch->id == GPOINTER_TO_UINT (l->data))
+            {
+              watch_update (watch, now);
+              break;
+            }
+        }
+    }
+
+  g_list_free (due);
+}
+
+static gboolean ticker_timeout (gpointer data);
+
+static void
+schedule_ticker (void)
+{
+  GList *l;
+  time_t now, next_update = 0;
+
+  if (ticker_source)
+    ticker_source = (g_source_remove (ticker_source), 0);
+
+  if (!ticker_active || !watches)
+    return;
+
+  for (l = watches; l; l = l->next)
+    {
+      TimeDiffWatch *watch = l->data;
+
+      if (l == watches || watch->next_update < next_update)
+        next_update = watch->next_update;
+    }
+
+  time (&now);
+
+  ticker_source = g_timeout_add_seconds (MAX (next_update - now, 0),
+                                         ticker_timeout,
+                                         NULL);
+}
+
+static gboolean
+ticker_timeout (gpointer data)
+{
+  ticker_source = 0;
+
+  update_watches (FALSE);
+  schedule_ticker ();
+
+  return FALSE;
+}
+
+/**
+ * hd_time_difference_add_watch:
+ * @event_time: the reference time of the label
+ * @func: called with the relative time text on each unit boundary
+ * @data: user data for @func
+ *
+ * Registers a relative time label on the shared ticker. If the ticker is
+ * active @func is called immediately with the current text.
+ *
+ * Returns: the watch id to pass to hd_time_difference_remove_watch()
+ */
+guint
+hd_time_difference_add_watch (time_t               event_time,
+                              HDTimeDifferenceFunc func,
+                              gpointer             data)
+{
+  TimeDiffWatch *watch;
+  guint id;
+
+  g_return_val_if_fail (func, 0);
+
+  id = next_watch_id++;
+
+  watch = g_slice_new0 (TimeDiffWatch);
+  watch->id = id;
+  watch->time = event_time;
+  watch->func = func;
+  watch->data = data;
+
+  watches = g_list_prepend (watches, watch);
+
+  if (ticker_active)
+    {
+      time_t now;
+
+      time (&now);
+      watch_update (watch, now);
+    }
+
+  schedule_ticker ();
+
+  return id;
+}
+
+void
+hd_time_difference_remove_watch (guint id)
+{
+  GList *l;
+
+  for (l = watches; l; l = l->next)
+    {
+      TimeDiffWatch *watch = l->data;
+
+      if (watch->id == id)
+        {
+          watches = g_list_delete_link (watches, l);
+          g_slice_free (TimeDiffWatch, watch);
+          break;
+        }
+    }
+
+  schedule_ticker ();
+}
+
+/**
+ * hd_time_difference_set_active:
+ * @active: whether the ticker should run
+ *
+ * Stops the shared ticker (e.g. while the display is off) or restarts it,
+ * updating all watches immediately.
+ */
+void
+hd_time_difference_set_active (gboolean active)
+{
+  if (ticker_active == !!active)
+    return;
+
+  ticker_active = !!active;
+
+  if (ticker_active)
+    update_watches (TRUE);
+
+  schedule_ticker ();
+}
+
 #ifdef COMPILE_FOR_TEST
 typedef struct
 {
@@ -25,8 +25,26 @@
 
 G_BEGIN_DECLS
 
-char   *hd_time_difference_get_text (time_t difference);
-time_t  hd_time_difference_get_timeout (time_t difference);
+/**
+ * HDTimeDifferenceFunc:
+ * @text: the localized relative time text or %NULL if no time should be
+ *        displayed. Owned by the time difference cache.
+ * @data: user data passed to hd_time_difference_add_watch()
+ *
+ * Called by the shared ticker whenever the relative time text of a watch
+ * changes unit boundaries.
+ */
+typedef void (*HDTimeDifferenceFunc) (const gchar *text,
+                                      gpointer     data);
+
+char   *hd_time_difference_get_text     (time_t               difference);
+time_t  hd_time_difference_get_timeout  (time_t               difference);
+
+guint   hd_time_difference_add_watch    (time_t               event_time,
+                                         HDTimeDifferenceFunc func,
+                                         gpointer             data);
+void    hd_time_difference_remove_watch (guint                id);
+void    hd_time_difference_set_active   (gboolean             active);
 
 G_END_DECLS
 
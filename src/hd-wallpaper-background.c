@@ -119,20 +119,27 @@ hd_wallpaper_background_set_for_current_view (HDBackground   *background,
                                               GCancellable   *cancellable)
 {
   HDWallpaperBackgroundPrivate *priv = HD_WALLPAPER_BACKGROUND (background)->priv;
+  GCancellable *job_cancellable;
   CommandData *data;
 
   gboolean error_dialogs = TRUE;
  
+  job_cancellable = hd_backgrounds_job_cancellable_new (cancellable);
+
   data = command_data_new (priv->file,
-                           cancellable);
+                           job_cancellable);
 
   hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
                                           priv->file,
+                                          HD_BACKGROUNDS_ALL_VIEWS,
                                           error_dialogs,
-                                          cancellable,
+                                          TRUE,
+                                          job_cancellable,
                                           (HDCommandCallback) create_cached_image_command,
                                           data,
                                           (GDestroyNotify) command_data_free);
+
+  g_object_unref (job_cancellable);
 }
 
 static void
@@ -153,7 +160,12 @@ create_cached_image_command (CommandData *data)
                                          &error);
 
   if (!pixbuf)
-    goto cleanup;
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        hd_command_thread_pool_command_failed ();
+      g_clear_error (&error);
+      goto cleanup;
+    }
 
   for (view = 0; view < HD_DESKTOP_VIEWS; view++)
     {
@@ -174,12 +186,19 @@ create_cached_image_command (CommandData *data)
                                         &error);
 
       if (error)
-        g_clear_error (&error);
+        {
+          if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            hd_command_thread_pool_command_failed ();
+          g_clear_error (&error);
+        }
 
       g_object_unref (sub);
     }
 
 cleanup:
+  if (g_cancellable_is_cancelled (data->cancellable))
+    hd_command_thread_pool_command_cancelled ();
+
   if (pixbuf)
     g_object_unref (pixbuf);
   g_free (etag);
@@ -37,6 +37,7 @@
 #include <stdlib.h>
 
 #include "hd-backgrounds.h"
+#include "hd-cairo-surface-cache.h"
 #include "hd-notification-manager.h"
 #include "hd-system-notifications.h"
 #include "hd-incoming-events.h"
@@ -352,6 +353,9 @@ main (int argc, char **argv)
     }
   hd_stamp_file_init (HD_HOME_STAMP_FILE);
 
+  /* Decode theme images while the rest is set up */
+  hd_cairo_surface_cache_preload (hd_cairo_surface_cache_get ());
+
   /* Backgrounds */
   hd_backgrounds_startup (hd_backgrounds_get ());
 
@@ -419,6 +423,9 @@ main (int argc, char **argv)
   
   g_rename (HD_HOME_STAMP_FILE, HD_HOME_STAMP_FILE".sav");
 
+  /* Write the background info file if an update is still pending */
+  hd_backgrounds_shutdown (hd_backgrounds_get ());
+
   /* We got a signal, flush the database.  How we do it breaks
    * if somebody has taken reference of the nm, but we don't. */
   g_object_unref (hd_notification_manager_get ());